@@ -6,6 +6,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 
 namespace ccedar {
   // typedefs
@@ -57,6 +58,13 @@ namespace ccedar {
       const int to = _follow (from, 0);
       return _array[to].value;
     }
+    // build double array from sorted keys at once; children of each node
+    // are placed once, so no _resolve () happens unlike update ()
+    void build (const size_t num, const key_type* const* key, const size_t* len, const value_type* val) {
+      clear ();
+      _initialize ();
+      if (num) _build (0, key, len, val, 0, num, 0);
+    }
     void set_array (void* p, size_t size_ = 0) { // ad-hoc
       clear ();
       _array = static_cast <node*> (p);
@@ -87,6 +95,32 @@ namespace ccedar {
     int     _no_delete;
     int     _ok[MAX_KEY_CODE + 1];
     //
+    // place children of from for keys [begin, end) sharing prefix of depth
+    void _build (const size_t from, const key_type* const* key, const size_t* len, const value_type* val, const size_t begin, const size_t end, const size_t depth) {
+      std::vector <ukey_type> label;
+      std::vector <size_t> first; // first key of each label
+      for (size_t i = begin; i < end; ++i) {
+        const ukey_type c = depth < len[i] ? static_cast <ukey_type> (key[i][depth]) : 0;
+        if (! label.empty () && c <= label.back ()) {
+          if (c == label.back ()) continue;
+          _err (__FILE__, __LINE__, "keys are not sorted\n");
+        }
+        label.push_back (c);
+        first.push_back (i);
+      }
+      first.push_back (end);
+      const int base = (label.size () == 1 ? _find_place () : _find_place (&label.front (), &label.back ())) ^ label.front ();
+      _array[from].base = base;
+      _ninfo[from].child = label.front ();
+      for (size_t j = 0; j < label.size (); ++j) {
+        const int to = _pop_enode (base, label[j], static_cast <int> (from));
+        _ninfo[to].sibling = j + 1 < label.size () ? label[j + 1] : 0;
+        if (! label[j]) _array[to].value = val[first[j + 1] - 1]; // the last one wins as update ()
+      }
+      for (size_t j = 0; j < label.size (); ++j)
+        if (label[j])
+          _build (static_cast <size_t> (base ^ label[j]), key, len, val, first[j], first[j + 1], depth + 1);
+    }
     static void _err (const char* fn, const int ln, const char* msg)
     { std::fprintf (stderr, "%s [%d]: %s", fn, ln, msg); std::exit (1); }
     template <typename T>
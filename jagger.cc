@@ -3,114 +3,20 @@
 // Copyright (c) 2022 Naoki Yoshinaga <ynaga@iis.u-tokyo.ac.jp>
 #include <jagger.h>
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <deque>
 
 #ifndef _WIN32
+#include <dirent.h>
 #define _isatty ::isatty
-#define _mmap ::mmap
-#define _munmap ::munmap
-#define __open ::open
+#define _fileno ::fileno
 #endif
 
 #ifdef _WIN32
 #include "getopt.h"
-#define PROT_READ    0x1  // Pages can be read
-#define PROT_WRITE   0x2  // Pages can be written to
-#define PROT_EXEC    0x4  // Pages can be executed
-#define PROT_NONE    0x0  // Pages cannot be accessed
-#define PAGE_READONLY    0x02
-#define PAGE_READWRITE   0x04
-#define PAGE_EXECUTE     0x10
-#define PAGE_NOACCESS    0x01
-#define MAP_SHARED (FILE_MAP_READ | FILE_MAP_WRITE)
 #define JAGGER_DEFAULT_MODEL "..\\model\\kyoto+kwdlc"
 
-void* _mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
-    HANDLE hFile = INVALID_HANDLE_VALUE;
-    if (fd != -1) {
-        hFile = (HANDLE)_get_osfhandle(fd);  // Convert file descriptor to HANDLE
-        if (hFile == INVALID_HANDLE_VALUE) return NULL;  // Invalid file handle
-    }
-
-    // Open or create file mapping
-    HANDLE hMap = CreateFileMapping(hFile, 
-        NULL, 
-        PAGE_READWRITE, 
-        0, 
-        0, 
-        NULL);
-
-    if (hMap == NULL) {
-        DWORD lastError = GetLastError();
-        return NULL;
-    }
-
-    // Create a view of the file (map memory)
-    void* mappedAddr = MapViewOfFile(hMap, 
-        FILE_MAP_WRITE, 
-        0, 
-        0, 
-        length);
-
-    if (mappedAddr == NULL) {
-        DWORD lastError = GetLastError();
-        CloseHandle(hMap);
-        return NULL;
-    }
-
-    // Return mapped memory address
-    return mappedAddr;
-}
-
-void _munmap(void* addr, size_t length) {
-    UnmapViewOfFile(addr);
-}
-
-void utf8_to_wide(const char* utf8_str, std::wstring& utf16_str) {
-
-    if (utf8_str == NULL) {
-        return;
-    }
-
-    int len = MultiByteToWideChar(CP_UTF8, 0, utf8_str, -1, NULL, 0);
-    if (len == 0) {
-        return;
-    }
-
-    std::vector<unsigned char>buf((len + 1) * sizeof(wchar_t));
-    if (MultiByteToWideChar(CP_UTF8,
-        0, utf8_str,
-        -1,
-        (LPWSTR)&buf[0],
-        len)) {
-        utf16_str = std::wstring((const wchar_t*)&buf[0]);
-    }
-
-    return;
-}
-
-void wide_to_utf8(const wchar_t* utf16_str, std::string& utf8_str) {
-
-    if (utf16_str == NULL) {
-        return;
-    }
-
-    int len = WideCharToMultiByte(CP_UTF8, 0, utf16_str, -1, NULL, 0, NULL, NULL);
-    if (len == 0) {
-        return;
-    }
-
-    std::vector<unsigned char>buf((len + 1) * sizeof(char));
-    if (WideCharToMultiByte(CP_UTF8,
-        0, utf16_str,
-        -1,
-        (LPSTR)&buf[0],
-        len, NULL, NULL)) {
-        utf8_str = std::string((const char*)&buf[0]);
-    }
-
-    return;
-}
-
 void expand_path(std::string& m, char* currrent_directory_path) {
     std::wstring w;
     utf8_to_wide(m.c_str(), w);
@@ -126,152 +32,289 @@ void expand_path(std::string& m, char* currrent_directory_path) {
         wide_to_utf8(&buf[0], m);
     }
 }
+#endif
 
-int __open(const char* utf8_path, int oflag, ...) {
-
-    std::wstring wide_path;
-
-    utf8_to_wide(utf8_path, wide_path);
-    if (wide_path.length() == 0) {
-        return -1;  // Conversion failed
-    }
-
-    // Use CreateFileW to open the file with the appropriate flags
-    HANDLE hFile = CreateFileW(
-        wide_path.c_str(),
-        GENERIC_READ | GENERIC_WRITE,
-        FILE_SHARE_READ,
-        NULL,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL);
-
-    if (hFile == INVALID_HANDLE_VALUE) {
-        DWORD lastError = GetLastError();
-        return -1;  // Return error if CreateFileW fails
+// list regular files in a directory; return false if path is not a directory
+static bool list_dir (const std::string& path, std::vector <std::string>& files) {
+#ifdef _WIN32
+    std::wstring w;
+    utf8_to_wide((path + "\\*").c_str(), w);
+    WIN32_FIND_DATAW data;
+    HANDLE h = FindFirstFileW(w.c_str(), &data);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    do {
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+        std::string fn;
+        wide_to_utf8(data.cFileName, fn);
+        files.push_back(path + "\\" + fn);
+    } while (FindNextFileW(h, &data));
+    FindClose(h);
+    return true;
+#else
+    DIR* dir = opendir (path.c_str ());
+    if (! dir) return false;
+    for (struct dirent* e = 0; (e = readdir (dir)); ) {
+        struct stat st;
+        const std::string fn = path + "/" + e->d_name;
+        if (stat (fn.c_str (), &st) == 0 && S_ISREG (st.st_mode)) files.push_back (fn);
     }
-
-    // Convert the file handle to a file descriptor (for compatibility with _open)
-    return _open_osfhandle((intptr_t)hFile, 0);  // The second argument 0 indicates no extra flags
+    closedir (dir);
+    return true;
+#endif
 }
 
-off_t __lseek(int fd, off_t offset, int whence) {
-    // Convert the file descriptor to a Windows HANDLE
-    HANDLE hFile = (HANDLE)_get_osfhandle(fd);
-
-    if (hFile == INVALID_HANDLE_VALUE) {
-        return -1;  // Invalid file descriptor
+namespace jagger { // tag files listed in a manifest (or a directory) in parallel (-F)
+  struct job_t {
+    const tagger* t;
+    std::vector <std::pair <long, std::string> > files; // <size, path>, largest first
+    std::string outdir;
+    std::atomic <size_t> next; // shared cursor; idle workers take the next file
+    std::atomic <long> failed;
+  };
+  static std::string _out_path (const std::string& outdir, const std::string& fn)
+  { return outdir + "/" + fn.substr (fn.find_last_of ("/\\") + 1); }
+  // tag i-th file with t; huge ones are split into chunks tagged by nthreads
+  template <const bool TAGGING>
+  static void tag_file (const tagger& t, job_t* job, const size_t i, const size_t nthreads = 0) {
+    const std::string& fn = job->files[i].second;
+    const std::string out = _out_path (job->outdir, fn);
+    const int in_fd = __open (fn.c_str (), O_RDONLY);
+    const int out_fd = in_fd == -1 ? -1 : __open (out.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in_fd == -1 || out_fd == -1) {
+      std::fprintf (stderr, "warning: cannot tag %s into %s; skipped.\n", fn.c_str (), out.c_str ());
+      ++job->failed;
+    } else if (nthreads)
+      t.run_parallel <TAGGING> (nthreads, in_fd, out_fd); // window by window
+    else
+      t.run <TAGGING, false> (in_fd, out_fd); // reader / writer bound memory per worker
+    if (in_fd != -1) _close (in_fd);
+    if (out_fd != -1) _close (out_fd);
+  }
+  template <const bool TAGGING>
+  static void tag_files (job_t* job, const size_t w) { // w-th worker
+    const tagger& t = job->t->worker (w);
+    t.bind (); // read node-local replicas
+    for (size_t i = 0; (i = job->next++) < job->files.size (); )
+      tag_file <TAGGING> (t, job, i);
+  }
+  static long tag_files (const tagger& t, const bool tagging, const std::string& manifest, const std::string& outdir, const size_t nthreads) {
+    std::vector <std::string> fns;
+    if (! list_dir (manifest, fns)) { // manifest
+      const mapped_file file (manifest);
+      line_scanner ls (file.begin (), file.end ());
+      for (const char *line (0), *eol (0); ls.next (line, eol); ) {
+        std::string fn (line, eol);
+        while (! fn.empty () && (fn[fn.size () - 1] == '\n' || fn[fn.size () - 1] == '\r')) fn.erase (fn.size () - 1);
+        if (! fn.empty ()) fns.push_back (fn);
+      }
     }
-
-    DWORD dwMoveMethod = 0;
-    switch (whence) {
-    case SEEK_SET:
-        dwMoveMethod = FILE_BEGIN;
-        break;
-    case SEEK_CUR:
-        dwMoveMethod = FILE_CURRENT;
-        break;
-    case SEEK_END:
-        dwMoveMethod = FILE_END;
-        break;
-    default:
-        return -1;  // Invalid whence value
+    job_t job;
+    job.t = &t;
+    job.outdir = outdir;
+    job.next = 0;
+    job.failed = 0;
+    long bytes = 0;
+    for (size_t i = 0; i < fns.size (); ++i) {
+      const int fd = __open (fns[i].c_str (), O_RDONLY);
+      const long size = fd == -1 ? 0 : static_cast <long> (__lseek (fd, 0, SEEK_END));
+      if (fd != -1) _close (fd);
+      job.files.push_back (std::make_pair (size, fns[i]));
+      bytes += size;
     }
-
-    // Move the file pointer to the specified offset
-    LARGE_INTEGER liOffset;
-    liOffset.QuadPart = offset;
-
-    // Use SetFilePointerEx to set the file pointer
-    LARGE_INTEGER liNewPointer;
-    if (SetFilePointerEx(hFile, liOffset, &liNewPointer, dwMoveMethod)) {
-        return (off_t)liNewPointer.QuadPart;
+    std::sort (job.files.begin (), job.files.end (), std::greater <std::pair <long, std::string> > ());
+    { // inputs with the same name would overwrite each other's output
+      std::map <std::string, std::string> out2fn;
+      for (size_t i = 0; i < job.files.size (); ++i) {
+        const std::string& fn = job.files[i].second;
+        const std::pair <std::map <std::string, std::string>::iterator, bool> r = out2fn.insert (std::make_pair (_out_path (outdir, fn), fn));
+        ERR_IF (! r.second, "%s and %s are both tagged into %s", r.first->second.c_str (), fn.c_str (), r.first->first.c_str ());
+      }
     }
-
-    // If SetFilePointerEx fails, return -1
-    return -1;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+    const size_t n = std::max (nthreads, size_t (1));
+    size_t nhuge = 0; // files larger than a fair share of a worker stall the others
+    for (; n > 1 && nhuge < job.files.size () && job.files[nhuge].first > bytes / static_cast <long> (n); ++nhuge)
+      if (tagging) tag_file <true> (t, &job, nhuge, n); else tag_file <false> (t, &job, nhuge, n);
+    job.next = nhuge;
+    std::vector <std::thread> pool;
+    for (size_t i = 0; i < n; ++i)
+      pool.push_back (tagging ? std::thread (tag_files <true>, &job, i) : std::thread (tag_files <false>, &job, i));
+    for (size_t i = 0; i < pool.size (); ++i)
+      pool[i].join ();
+    std::fprintf (stderr, "tagged %ld files (%ld bytes; %ld split) with %ld threads; %.2f sec.\n", static_cast <long> (job.files.size () - job.failed), bytes, static_cast <long> (nhuge), static_cast <long> (pool.size ()),
+                  std::chrono::duration <double> (std::chrono::steady_clock::now () - start).count ());
+    return job.failed;
+  }
 }
-#endif
 
-namespace jagger {
-  class tagger {
+namespace jagger { // differential self-check of tagging paths (-s)
+  class checker {
   private:
-    ccedar::da_  _da;  // there may be cache friendly alignment
-    uint16_t*    _c2i; // UTF8 char and BOS -> id
-    feat_info_t* _p2f; // pattern id -> feature (info)
-    char*        _fs;  // feature strings
-    std::vector <std::pair <void*, size_t> > _mmaped;
-    void* _read_array (const std::string& fn) {
-      int fd = __open(fn.c_str (), O_RDONLY);
-      ERR_IF (fd == -1, "no such file: %s", fn.c_str ());
-      const size_t size = __lseek(fd, 0, SEEK_END); // get size
-      __lseek(fd, 0, SEEK_SET);
-      void *data = _mmap (0, size, PROT_READ, MAP_SHARED, fd, 0);
-      _close (fd);
-      _mmaped.push_back (std::make_pair (data, size));
-      return data;
+    const tagger &_tagger, &_segmenter; // models for tagging / -w
+    uint64_t _seed; // 64-bit LCG; unsigned long is 32-bit on MSVC
+    int _failed;
+    size_t _rand () { return _seed = _seed * 6364136223846793005ULL + 1442695040888963407ULL, static_cast <size_t> (_seed >> 33); }
+    static double _now () { return std::chrono::duration <double> (std::chrono::steady_clock::now ().time_since_epoch ()).count (); }
+    template <const bool TAGGING, const bool TTY>
+    static std::string _run (const tagger& t, const std::string& input, sentence_cache* cache = 0, const size_t nthreads = 0, const size_t min_chunk = 0, const size_t window = 1 << 24) { // via temporary files
+      FILE *in (std::tmpfile ()), *out (std::tmpfile ());
+      ERR_IF (! in || ! out, "cannot create temporary files%s", "");
+      std::fwrite (input.data (), 1, input.size (), in);
+      std::fflush (in);
+      __lseek (_fileno (in), 0, SEEK_SET);
+      if (cache) t.run <TAGGING, TTY> (*cache, _fileno (in), _fileno (out));
+      else if (nthreads) t.run_parallel <TAGGING> (nthreads, _fileno (in), _fileno (out), min_chunk, window);
+      else t.run <TAGGING, TTY> (_fileno (in), _fileno (out));
+      std::string ret;
+      __lseek (_fileno (out), 0, SEEK_SET);
+      char buf[BUF_SIZE];
+      for (long n = 0; (n = ::read (_fileno (out), buf, BUF_SIZE)) > 0; ) ret.append (buf, n);
+      std::fclose (in);
+      std::fclose (out);
+      return ret;
     }
-  public:
-    tagger () : _da (), _c2i (0), _p2f (0), _fs (0), _mmaped () {}
-    ~tagger () {
-      for (size_t i = 0; i < _mmaped.size (); ++i)
-        _munmap (_mmaped[i].first, _mmaped[i].second);
+    template <const bool TAGGING>
+    std::string _stream (const tagger& t, const std::string& input, const size_t max_chunk, sentence_cache* cache = 0) {
+      std::string ret;
+      {
+        simple_writer writer (ret);
+        stream_tagger <TAGGING> st (t, writer, cache);
+        for (size_t i (0), n (0); i < input.size (); i += n)
+          st.feed (&input[i], n = std::min (input.size () - i, 1 + _rand () % max_chunk));
+        st.finish ();
+      }
+      return ret;
     }
-    void read_model (const std::string& m) { // read patterns
-      _da.set_array (_read_array (m + ".da"));
-      _c2i = static_cast <uint16_t*> (_read_array (m + ".c2i"));
-      _p2f = static_cast <feat_info_t*> (_read_array (m + ".p2f"));
-      _fs  = static_cast <char*> (_read_array (m + ".fs"));
+    template <const bool TAGGING>
+    std::string _job (const tagger& t, const std::string& input, const size_t max_slice, sentence_cache* cache = 0) {
+      std::string ret;
+      tag_job <TAGGING> job (t, input.data (), input.size (), cache);
+      while (! job.resume (1 + _rand () % max_slice))
+        ret += job.output (), job.output ().clear ();
+      return ret + job.output ();
     }
-    void write_feature (simple_writer& writer, const bool concat, const feat_info_t finfo) const {
-      IF_COMPACT (writer.write (&_fs[finfo.core_feat_offset], finfo.core_feat_len));
-      if (concat) { // as unknown words
-        IF_NOT_COMPACT (writer.write (&_fs[finfo.feat_offset], finfo.core_feat_len));
-        writer.write (",*,*,*\n", 7);
+    template <const bool TAGGING>
+    static std::string _batch (const tagger& t, const std::string& input, const bool one_by_one = false, sentence_cache* cache = 0) { // lines as inputs
+      std::vector <std::pair <const char*, size_t> > lines;
+      for (size_t i (0), j (0); i < input.size (); i = j + 1) {
+        j = std::min (input.find ('\n', i), input.size ());
+        lines.push_back (std::make_pair (&input[i], j - i));
+      }
+      std::vector <word_t> words, words_;
+      std::vector <size_t> offsets, offsets_;
+      if (one_by_one) { // no other input follows a line
+        offsets.assign (1, 0);
+        for (size_t i = 0; i < lines.size (); ++i) {
+          t.tag_batch <TAGGING> (&lines[i], 1, words_, offsets_);
+          words.insert (words.end (), words_.begin (), words_.end ());
+          offsets.push_back (words.size ());
+        }
       } else
-        writer.write (&_fs[finfo.feat_offset], finfo.feat_len);
-    }
-    template <const bool TAGGING, const bool TTY>
-    void run () const {
-      union { struct { uint32_t shift : MAX_PATTERN_BITS, ctype : 4, id : 20; bool concat : 1; }; int r; } s_prev = {}, s = {};
-      feat_info_t finfo = { _c2i[CP_MAX + 1] }; // BOS
-      simple_reader reader;
-      simple_writer writer;
-      for (;! reader.eob ();) {
-        if (*reader.ptr () == '\n') { // EOS
-          if (s_prev.r)
-            if (TAGGING) write_feature (writer, s_prev.concat, finfo);
-          writer.write (TAGGING ? "EOS\n" : "\n", TAGGING ? 4 : 1);
-          s.shift = 1;
-          s_prev.r = 0; // *
-          finfo.ti = _c2i[CP_MAX + 1]; // BOS
-          if (TTY) writer.flush (); // line buffering
-        } else {
-          s.r = _da.longestPatternSearch (reader.ptr (), reader.end (), finfo.ti, _c2i);
-          if (! s.shift) s.shift = u8_len (reader.ptr ());
-          if (s_prev.r &&  // word that may concat with the future context
-              ! (s.concat = (s_prev.ctype == s.ctype && // char type mismatch
-                             s_prev.ctype != OTHER &&   // kanji, symbol
-                             (s_prev.ctype != KANA || s_prev.shift + s.shift < 18)))) {
-            if (TAGGING)
-              write_feature (writer, s_prev.concat, finfo);
-            else
-              writer.write (" ", 1);
-          }
-          finfo = _p2f[s.id];
-          s_prev = s; // *
-          writer.write (reader.ptr (), s.shift);
+        t.tag_batch <TAGGING> (lines.data (), lines.size (), words, offsets, cache);
+      std::string ret;
+      for (size_t i = 0; i < lines.size (); ++i) {
+        for (size_t k = offsets[i]; k < offsets[i + 1]; ++k) {
+          if (! TAGGING && k > offsets[i]) ret += ' ';
+          ret.append (lines[i].first + words[k].begin, words[k].len);
+          if (TAGGING) ret += '\t', t.feature (words[k], ret), ret += '\n';
         }
-        reader.advance (s.shift);
-        if (! TTY && ! writer.writable (1 << MAX_FEATURE_BITS)) writer.flush ();
-        if (TTY && reader.eob ()) reader.read ();
-        if (! TTY && ! reader.readable (1 << MAX_PATTERN_BITS)) reader.read ();
+        ret += TAGGING ? "EOS\n" : "\n";
       }
-      if (s_prev.r) {
-        if (TAGGING) write_feature (writer, s_prev.concat, finfo);
-        writer.write (TAGGING ? "EOS\n" : "\n", TAGGING ? 4 : 1);
+      return ret;
+    }
+    void _report (const char* input, const char* mode, const char* path, const double elapsed, const std::string& ref, const std::string& ret) {
+      size_t i = 0;
+      for (; i < std::min (ref.size (), ret.size ()) && ref[i] == ret[i]; ++i) ;
+      const bool same = ref.size () == ret.size () && i == ref.size ();
+      if (! same) ++_failed;
+      std::fprintf (stderr, "%-8s %-4s %-16s %10.3f ms  %s", input, mode, path, elapsed * 1000, same ? "ok\n" : "MISMATCH");
+      if (! same) std::fprintf (stderr, " at byte %ld\n", static_cast <long> (i));
+    }
+    template <const bool TAGGING>
+    void _check (const char* name, const std::string& input, const bool valid) {
+      const tagger& t = TAGGING ? _tagger : _segmenter;
+      const char* mode = TAGGING ? "tag" : "seg";
+      double start = _now ();
+      const std::string ref = _run <TAGGING, false> (t, input);
+      _report (name, mode, "batch (ref)", _now () - start, ref, ref);
+      start = _now ();
+      std::string ret = _stream <TAGGING> (t, input, 1);
+      _report (name, mode, "stream (1B)", _now () - start, ref, ret);
+      start = _now ();
+      ret = _stream <TAGGING> (t, input, 4096);
+      _report (name, mode, "stream (random)", _now () - start, ref, ret);
+      start = _now ();
+      ret = _job <TAGGING> (t, input, 4096);
+      _report (name, mode, "job (random)", _now () - start, ref, ret);
+      if (valid) { // lines may end with partial characters otherwise
+        start = _now ();
+        ret = _batch <TAGGING> (t, input);
+        _report (name, mode, "batch (lines)", _now () - start, ref, ret);
+      } else { // truncated chars at line ends must not see the next line
+        start = _now ();
+        ret = _batch <TAGGING> (t, input);
+        _report (name, mode, "batch (lines)", _now () - start, _batch <TAGGING> (t, input, true), ret);
+      }
+      start = _now ();
+      ret = _run <TAGGING, false> (t, input, 0, 7, 64); // 7 chunks even for small inputs
+      _report (name, mode, "parallel (7)", _now () - start, ref, ret);
+      start = _now ();
+      ret = _run <TAGGING, false> (t, input, 0, 7, 64, 1 << 10); // many rounds of windows
+      _report (name, mode, "parallel (window)", _now () - start, ref, ret);
+      sentence_cache cache (256);
+      start = _now ();
+      ret = _run <TAGGING, false> (t, input, &cache);
+      _report (name, mode, "batch (cached)", _now () - start, ref, ret);
+      // the first pass fills caches, the second hits them
+      sentence_cache c1 (256), c2 (256), c3 (256);
+      start = _now ();
+      ret = _stream <TAGGING> (t, input, 4096, &c1);
+      if (ret == ref) ret = _stream <TAGGING> (t, input, 4096, &c1);
+      _report (name, mode, "stream (cached)", _now () - start, ref, ret);
+      start = _now ();
+      ret = _job <TAGGING> (t, input, 4096, &c2);
+      if (ret == ref) ret = _job <TAGGING> (t, input, 4096, &c2);
+      _report (name, mode, "job (cached)", _now () - start, ref, ret);
+      const std::string lines = valid ? ref : _batch <TAGGING> (t, input, true);
+      start = _now ();
+      ret = _batch <TAGGING> (t, input, false, &c3);
+      if (ret == lines) ret = _batch <TAGGING> (t, input, false, &c3);
+      _report (name, mode, "lines (cached)", _now () - start, lines, ret);
+      // interactive IO depends on read boundaries; compare within one read
+      size_t len = 0, max_line = 0;
+      for (size_t i = 0; i < input.size () && i < BUF_SIZE / 2; ++i)
+        if (input[i] == '\n') max_line = std::max (max_line, i - len), len = i + 1;
+      if (len && max_line < BUF_SIZE >> 6) {
+        const std::string prefix (input, 0, len);
+        start = _now ();
+        ret = _run <TAGGING, true> (t, prefix);
+        _report (name, mode, "interactive", _now () - start, _run <TAGGING, false> (t, prefix), ret);
       }
     }
+  public:
+    checker (const tagger& t, const tagger& s, const unsigned long seed) : _tagger (t), _segmenter (s), _seed (seed), _failed (0) {}
+    int run (const std::string& sample) { // return the number of mismatches
+      std::string input[4];
+      input[0] = sample;
+      input[1] = sample; // invalid UTF-8
+      for (size_t i = 0; i < input[1].size () / 256; ++i)
+        input[1][_rand () % input[1].size ()] = static_cast <char> (_rand ());
+      input[1] += "\xf0"; // truncated at EOF
+      for (size_t i = 0; i < sample.size (); ++i) { // empty lines
+        if ((sample[i] & 0xc0) != 0x80 && _rand () % 64 == 0) input[2] += "\n\n";
+        input[2] += sample[i];
+      }
+      input[3] = sample; // one huge line w/o trailing newline
+      std::replace (input[3].begin (), input[3].end (), '\n', ' ');
+      while (input[3].size () < BUF_SIZE * 4) input[3] += input[3] + "\xe3\x80\x80";
+      const char* name[] = { "sample", "invalid", "empty", "huge" };
+      for (size_t i = 0; i < 4; ++i) {
+        _check <true>  (name[i], input[i], i != 1);
+        _check <false> (name[i], input[i], i != 1);
+      }
+      std::fprintf (stderr, "%d mismatch(es)\n", _failed);
+      return _failed;
+    }
   };
 }
 
@@ -285,8 +328,23 @@ int main (int argc, char** argv) {
     
   bool tagging = true;
   bool interactive = false;
+  size_t lattice = 0;
+  bool warmup = false;
+  bool keep = false;
+  int node = -1;
+  long check = -1;
+  bool inspect = false;
+  size_t cache = 0;
+  bool postings = false;
+  int field = -1;
+  bool normalize = false;
+  std::string manifest, outdir (".");
+  size_t max_resident (0);
+  bool residency = false;
+  size_t jobs (0);
+  size_t nthreads = std::max (1u, std::thread::hardware_concurrency ());
   { // options (minimal)
-    for (int opt = 0; (opt = getopt(argc, argv, "m:u:whc")) != -1;)
+    for (int opt = 0; (opt = getopt(argc, argv, "m:u:n:N:s:C:l:F:o:t:T:j:whcpkibfr")) != -1;)
       switch (opt) {
         case 'm': 
         {
@@ -297,24 +355,111 @@ int main (int argc, char** argv) {
                     m.pop_back();
                 }
             }
-            m += "\\patterns"; 
+#ifdef _WIN32
+            m += "\\patterns";
+#else
+            m += "/patterns";
+#endif
         break;
         }
         case 'c': interactive = true; break;
         case 'w': tagging = false; break;
-        case 'h': errx (1, "Pattern-based Jappanese Morphological Analyzer\nCopyright (c) 2023- Naoki Yoshinaga, All rights reserved.\n\nUsage: %s [-m dir w] < input\n\nOptions:\n -m dir\tdirectory for compiled patterns (default: " JAGGER_DEFAULT_MODEL ")\n -w\tperform only segmentation\n", argv[0]);
+        case 'n': lattice = std::strtoul (optarg, NULL, 10); break;
+        case 'p': warmup = true; break;
+        case 'k': keep = true; break;
+        case 'N': node = std::atoi (optarg); break;
+        case 'i': inspect = true; break;
+        case 'f': normalize = true; break;
+        case 'F': manifest = optarg; break;
+        case 'o': outdir = optarg; break;
+        case 't': nthreads = std::strtoul (optarg, NULL, 10); break;
+        case 'T': max_resident = std::strtoul (optarg, NULL, 10) << 20; break;
+        case 'r': residency = true; break;
+        case 'j': jobs = std::strtoul (optarg, NULL, 10); break;
+        case 'b': postings = true; break;
+        case 'l': field = std::atoi (optarg); break;
+        case 'C': cache = std::strtoul (optarg, NULL, 10); break;
+        case 's': check = std::strtol (optarg, NULL, 10); break;
+        case 'h': errx (1, "Pattern-based Jappanese Morphological Analyzer\nCopyright (c) 2023- Naoki Yoshinaga, All rights reserved.\n\nUsage: %s [-m dir -n k -N node -s seed -C num -l field -F list -o dir -t threads -T MB -j threads -wcpkibfr] < input\n\nOptions:\n -m dir\tdirectory for compiled patterns (default: " JAGGER_DEFAULT_MODEL ")\n -w\tperform only segmentation\n -n k\toutput lattice with k alternative patterns per position\n -c\tinteractive (line-buffered) IO\n -p\tpre-fault model pages at startup\n -k\tkeep model resident for other processes (no tagging)\n -N node\tpin to NUMA node and tag with a node-local copy of model; -F / -j threads use copies on every node from node\n -s seed\tcompare all tagging paths on (perturbed) input; report timings\n -i\tinspect model; profile patterns on input unless it is a terminal\n -C num\tcache outputs of num distinct lines\n -b\toutput binary postings (terms, positions, offsets) per line\n -l field\tuse field-th feature (e.g., 4 for lemma) as term for -b\n -f\tfold full/half-width characters (NFKC) in matching patterns\n -F list\ttag files in list (a manifest or directory) in parallel\n -o dir\toutput directory for -F (default: .)\n -t threads\tnumber of threads for -F (default: # cores)\n -T MB\tlet the OS reclaim model pages when process uses more than MB (not with -N / -s / -i / -k)\n -r\treport resident bytes of model sections at exit\n -j threads\ttag the whole input split into chunks in parallel (e.g., a huge line)\n", argv[0]);
       }
   }
 
+  ERR_IF (max_resident && (node >= 0 || check >= 0 || inspect || keep), "-T cannot be used with -N, -s, -i or -k%s", ""); // local copies / profiling / pinned pages
+
   jagger::tagger jagger;
-  jagger.read_model(m);
+  if (keep) jagger.keep_resident(m);
+  if (node >= 0)
+    ERR_IF (node >= numa_nodes () || ! bind_to_node (node), "cannot bind to NUMA node %d", node);
+  const bool features = (tagging && ! postings) || lattice || inspect || field >= 0;
+  jagger.read_model(m, features, lattice);
+  if (normalize) jagger.normalize();
+  if (node >= 0) jagger.replicate(node);
+  std::deque <jagger::tagger> replicas; // on the other NUMA nodes
+  if (node >= 0 && (! manifest.empty () || jobs)) { // worker i tags on node (node + i) % numa_nodes ()
+      std::vector <const jagger::tagger*> workers (1, &jagger);
+      for (int i = 1; i < numa_nodes (); ++i) {
+          const int node_ = (node + i) % numa_nodes ();
+          ERR_IF (! bind_to_node (node_), "cannot bind to NUMA node %d", node_); // first touch
+          replicas.emplace_back ();
+          replicas.back ().read_model(m, features, lattice);
+          if (normalize) replicas.back ().normalize();
+          replicas.back ().replicate(node_);
+          workers.push_back (&replicas.back ());
+      }
+      bind_to_node (node);
+      jagger.spread (workers);
+  }
+  if (warmup) jagger.warmup();
+
+  jagger.trim_over(max_resident);
 
-  if ((_isatty(0) == 1)||(interactive)){ // interactive IO
+  if (! manifest.empty ()) // files
+      return jagger::tag_files(jagger, tagging, manifest, outdir, nthreads) ? 1 : 0;
+
+  if (inspect) { // statistics
+      jagger.inspect(_isatty(0) == 1 ? -1 : 0);
+      return 0;
+  }
+
+  if (check >= 0) { // self-check
+      jagger::tagger segmenter;
+      segmenter.read_model(m, false);
+      if (normalize) segmenter.normalize();
+      std::string sample;
+      char buf[jagger::BUF_SIZE];
+      for (long n = 0; (n = ::read(0, buf, jagger::BUF_SIZE)) > 0; ) sample.append(buf, n);
+      return jagger::checker(jagger, segmenter, check).run(sample) ? 1 : 0;
+  }
+
+  if (lattice) { // alternatives
+      if ((_isatty(0) == 1)||(interactive)) jagger.run_lattice <true>(lattice); else jagger.run_lattice <false>(lattice);
+  }
+  else if (postings) { // for indexing
+#ifdef _WIN32
+      _setmode (_fileno (stdout), _O_BINARY); // no CRLF in binary output
+      _setmode (_fileno (stdin), _O_BINARY);  // offsets count input bytes
+#endif
+      if (field >= 0) jagger.run_postings <true>(field); else jagger.run_postings <false>();
+  }
+  else if (cache) { // repeated lines
+      jagger::sentence_cache c (cache);
+      if ((_isatty(0) == 1)||(interactive)) {
+          if (tagging) jagger.run <true, true>(c); else jagger.run <false, true>(c);
+      } else {
+          if (tagging) jagger.run <true, false>(c); else jagger.run <false, false>(c);
+      }
+      std::fprintf (stderr, "cache: %ld / %ld lines hit (%.1f%%)\n", static_cast <long> (c.hit ()), static_cast <long> (c.lookup ()), 100.0 * c.hit () / std::max (c.lookup (), uint64_t (1)));
+  }
+  else if ((_isatty(0) == 1)||(interactive)){ // interactive IO
           if (tagging) jagger.run <true, true>(); else jagger.run <false, true>();
       }
+  else if (jobs) { // whole input in parallel
+      if (tagging) jagger.run_parallel <true>(jobs); else jagger.run_parallel <false>(jobs);
+  }
   else { // batch
       if (tagging) jagger.run <true, false>(); else jagger.run <false, false>();
   }
 
+  if (residency) jagger.report_residency();
   return 0;
 }
@@ -4,32 +4,44 @@
 #ifndef JAGGER_H
 #define JAGGER_H
 #include <sys/stat.h>
-//#include <sys/mman.h>
-#include <io.h>
 #include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
 #include <Windows.h>
+#include <shlwapi.h>
 #define read  _read
 #define write _write
-//#include <unistd.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#define _close ::close
+#endif
 #include <stdint.h>
-#include <fcntl.h>
 //#include <err.h>
-#include <shlwapi.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstddef>
 #include <vector>
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <algorithm>
 #include <iterator>
+#include <chrono>
+#include <thread>
+#include <atomic>
 #include <ccedar_core.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#ifdef _WIN32
 #define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE __attribute__ ((always_inline))
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,15 +61,358 @@ void errx(int eval, const char* fmt, ...) {
 #define ERR_IF(condition, format, ...) \
   if (condition) errx (1, __FILE__ " [%d]: " format, __LINE__, __VA_ARGS__)
 
-#ifdef USE_COMPACT_DICT
-#define IF_COMPACT(e) e
-#define IF_NOT_COMPACT(e)
+#ifndef _WIN32
+#define _mmap ::mmap
+#define _munmap ::munmap
+#define __open ::open
+#define __lseek ::lseek
+#endif
+
+#ifdef _WIN32
+#define PROT_READ    0x1  // Pages can be read
+#define PROT_WRITE   0x2  // Pages can be written to
+#define PROT_EXEC    0x4  // Pages can be executed
+#define PROT_NONE    0x0  // Pages cannot be accessed
+#define PAGE_READONLY    0x02
+#define PAGE_READWRITE   0x04
+#define PAGE_EXECUTE     0x10
+#define PAGE_NOACCESS    0x01
+#define MAP_SHARED (FILE_MAP_READ | FILE_MAP_WRITE)
+#define MAP_FAILED ((void*)-1)
+
+void* _mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    if (fd != -1) {
+        hFile = (HANDLE)_get_osfhandle(fd);  // Convert file descriptor to HANDLE
+        if (hFile == INVALID_HANDLE_VALUE) return NULL;  // Invalid file handle
+    }
+
+    // Open or create file mapping
+    HANDLE hMap = CreateFileMapping(hFile, 
+        NULL, 
+        (prot & PROT_WRITE) ? PAGE_READWRITE : PAGE_READONLY, 
+        0, 
+        0, 
+        NULL);
+
+    if (hMap == NULL) {
+        DWORD lastError = GetLastError();
+        return NULL;
+    }
+
+    // Create a view of the file (map memory)
+    void* mappedAddr = MapViewOfFile(hMap, 
+        (prot & PROT_WRITE) ? FILE_MAP_WRITE : FILE_MAP_READ, 
+        0, 
+        0, 
+        length);
+
+    if (mappedAddr == NULL) {
+        DWORD lastError = GetLastError();
+        CloseHandle(hMap);
+        return NULL;
+    }
+    CloseHandle(hMap);  // the view keeps the mapping alive until UnmapViewOfFile
+
+    // Return mapped memory address
+    return mappedAddr;
+}
+
+void _munmap(void* addr, size_t length) {
+    UnmapViewOfFile(addr);
+}
+
+void utf8_to_wide(const char* utf8_str, std::wstring& utf16_str) {
+
+    if (utf8_str == NULL) {
+        return;
+    }
+
+    int len = MultiByteToWideChar(CP_UTF8, 0, utf8_str, -1, NULL, 0);
+    if (len == 0) {
+        return;
+    }
+
+    std::vector<unsigned char>buf((len + 1) * sizeof(wchar_t));
+    if (MultiByteToWideChar(CP_UTF8,
+        0, utf8_str,
+        -1,
+        (LPWSTR)&buf[0],
+        len)) {
+        utf16_str = std::wstring((const wchar_t*)&buf[0]);
+    }
+
+    return;
+}
+
+void wide_to_utf8(const wchar_t* utf16_str, std::string& utf8_str) {
+
+    if (utf16_str == NULL) {
+        return;
+    }
+
+    int len = WideCharToMultiByte(CP_UTF8, 0, utf16_str, -1, NULL, 0, NULL, NULL);
+    if (len == 0) {
+        return;
+    }
+
+    std::vector<unsigned char>buf((len + 1) * sizeof(char));
+    if (WideCharToMultiByte(CP_UTF8,
+        0, utf16_str,
+        -1,
+        (LPSTR)&buf[0],
+        len, NULL, NULL)) {
+        utf8_str = std::string((const char*)&buf[0]);
+    }
+
+    return;
+}
+
+int __open(const char* utf8_path, int oflag, ...) {
+
+    std::wstring wide_path;
+
+    utf8_to_wide(utf8_path, wide_path);
+    if (wide_path.length() == 0) {
+        return -1;  // Conversion failed
+    }
+
+    // Use CreateFileW to open the file with the appropriate flags
+    HANDLE hFile = CreateFileW(
+        wide_path.c_str(),
+        (oflag & (O_WRONLY | O_RDWR)) ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        (oflag & O_CREAT) ? ((oflag & O_TRUNC) ? CREATE_ALWAYS : OPEN_ALWAYS) : OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+
+    if (hFile == INVALID_HANDLE_VALUE) {
+        DWORD lastError = GetLastError();
+        return -1;  // Return error if CreateFileW fails
+    }
+
+    // Convert the file handle to a file descriptor (for compatibility with _open)
+    return _open_osfhandle((intptr_t)hFile, _O_BINARY);  // no CRLF translation on read / write
+}
+
+off_t __lseek(int fd, off_t offset, int whence) {
+    // Convert the file descriptor to a Windows HANDLE
+    HANDLE hFile = (HANDLE)_get_osfhandle(fd);
+
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return -1;  // Invalid file descriptor
+    }
+
+    DWORD dwMoveMethod = 0;
+    switch (whence) {
+    case SEEK_SET:
+        dwMoveMethod = FILE_BEGIN;
+        break;
+    case SEEK_CUR:
+        dwMoveMethod = FILE_CURRENT;
+        break;
+    case SEEK_END:
+        dwMoveMethod = FILE_END;
+        break;
+    default:
+        return -1;  // Invalid whence value
+    }
+
+    // Move the file pointer to the specified offset
+    LARGE_INTEGER liOffset;
+    liOffset.QuadPart = offset;
+
+    // Use SetFilePointerEx to set the file pointer
+    LARGE_INTEGER liNewPointer;
+    if (SetFilePointerEx(hFile, liOffset, &liNewPointer, dwMoveMethod)) {
+        return (off_t)liNewPointer.QuadPart;
+    }
+
+    // If SetFilePointerEx fails, return -1
+    return -1;
+}
+#endif
+
+// hint the OS to read in pages of a mapped region, then touch them
+static inline void prefault (const void* p, const size_t size) {
+#ifdef _WIN32
+  WIN32_MEMORY_RANGE_ENTRY r = { const_cast <void*> (p), size };
+  PrefetchVirtualMemory (GetCurrentProcess (), 1, &r, 0);
+#else
+  madvise (const_cast <void*> (p), size, MADV_WILLNEED);
+#endif
+  volatile char c = 0;
+  for (size_t i = 0; i < size; i += 4096)
+    c ^= static_cast <const char*> (p)[i];
+}
+
+// pin pages of a region in memory; may fail due to resource limits
+static inline bool lock_pages (const void* p, const size_t size) {
+#ifdef _WIN32
+  SIZE_T lo (0), hi (0);
+  GetProcessWorkingSetSize (GetCurrentProcess (), &lo, &hi);
+  SetProcessWorkingSetSize (GetCurrentProcess (), lo + size, hi + size);
+  return VirtualLock (const_cast <void*> (p), size) != 0;
+#else
+  return mlock (p, size) == 0;
+#endif
+}
+
+// let the OS reclaim resident pages of a read-only file mapping; they are
+// read again on use
+static inline void drop_pages (const void* p, const size_t size) {
+#ifdef _WIN32
+  VirtualUnlock (const_cast <void*> (p), size); // unlocked pages leave the working set
+#elif defined (MADV_COLD)
+  madvise (const_cast <void*> (p), size, MADV_COLD); // reclaimed first unless touched again
+#else
+  madvise (const_cast <void*> (p), size, MADV_DONTNEED);
+#endif
+}
+
+// NUMA placement; nodes are numbered from 0
+#ifdef _WIN32
+#include <Psapi.h>
+#else
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+static inline int numa_nodes () {
+#ifdef _WIN32
+  ULONG n = 0;
+  return GetNumaHighestNodeNumber (&n) ? static_cast <int> (n) + 1 : 1;
+#else
+  int n = 0;
+  for (char fn[64]; ; ++n) {
+    std::sprintf (fn, "/sys/devices/system/node/node%d", n);
+    if (access (fn, F_OK) != 0) break;
+  }
+  return n ? n : 1;
+#endif
+}
+
+// pin the calling thread to CPUs of the node; return the number of CPUs
+static inline int bind_to_node (const int node) {
+#ifdef _WIN32
+  ULONGLONG mask = 0;
+  if (! GetNumaNodeProcessorMask (static_cast <UCHAR> (node), &mask) || ! mask ||
+      ! SetThreadAffinityMask (GetCurrentThread (), static_cast <DWORD_PTR> (mask)))
+    return 0;
+  int n = 0;
+  for (; mask; mask &= mask - 1) ++n;
+  return n;
+#else
+  char fn[64];
+  std::sprintf (fn, "/sys/devices/system/node/node%d/cpulist", node);
+  FILE* fp = std::fopen (fn, "r");
+  if (! fp) return 0;
+  cpu_set_t set;
+  CPU_ZERO (&set);
+  int n = 0;
+  for (int b (0), e (0), c (0); (c = std::fscanf (fp, "%d-%d", &b, &e)) >= 1; ) {
+    if (c == 1) e = b;
+    for (; b <= e; ++b, ++n) CPU_SET (b, &set);
+    if (std::fgetc (fp) != ',') break;
+  }
+  std::fclose (fp);
+  return n && sched_setaffinity (0, sizeof (cpu_set_t), &set) == 0 ? n : 0;
+#endif
+}
+
+// allocate memory on the node; POSIX relies on first-touch by a bound thread
+static inline void* alloc_on_node (const size_t size, const int node) {
+#ifdef _WIN32
+  return VirtualAllocExNuma (GetCurrentProcess (), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, static_cast <DWORD> (node));
+#else
+  void* p = ::mmap (0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? 0 : p;
+#endif
+}
+
+static inline void free_on_node (void* p, const size_t size) {
+#ifdef _WIN32
+  VirtualFree (p, 0, MEM_RELEASE);
+#else
+  ::munmap (p, size);
+#endif
+}
+
+// node where the page holding p actually resides (-1 if unknown)
+static inline int node_of (const void* p) {
+#ifdef _WIN32
+  PSAPI_WORKING_SET_EX_INFORMATION info = {};
+  info.VirtualAddress = const_cast <void*> (p);
+  if (! QueryWorkingSetEx (GetCurrentProcess (), &info, sizeof (info)) || ! info.VirtualAttributes.Valid)
+    return -1;
+  return static_cast <int> (info.VirtualAttributes.Node);
 #else
-#define IF_COMPACT(e)
-#define IF_NOT_COMPACT(e) e
+  void* page = const_cast <void*> (p);
+  int status = -1;
+  return syscall (SYS_move_pages, 0, 1, &page, NULL, &status, 0) == 0 ? status : -1;
 #endif
+}
 
-static const size_t MAX_KEY_BITS     = 14; // also max POS ID
+// bytes of the process resident in memory (0 if unknown)
+static inline size_t resident_bytes () {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS pmc = {};
+  return GetProcessMemoryInfo (GetCurrentProcess (), &pmc, sizeof (pmc)) ? pmc.WorkingSetSize : 0;
+#else
+  FILE* fp = std::fopen ("/proc/self/statm", "r");
+  if (! fp) return 0;
+  long size (0), rss (0);
+  const bool ok = std::fscanf (fp, "%ld %ld", &size, &rss) == 2;
+  std::fclose (fp);
+  return ok ? static_cast <size_t> (rss) * sysconf (_SC_PAGESIZE) : 0;
+#endif
+}
+
+// bytes of a mapped (page-aligned) region resident in the process
+static inline size_t resident_size (const void* p, const size_t size) {
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo (&si);
+  const size_t page = si.dwPageSize, n = (size + page - 1) / page;
+  std::vector <PSAPI_WORKING_SET_EX_INFORMATION> info (n);
+  for (size_t i = 0; i < n; ++i)
+    info[i].VirtualAddress = static_cast <char*> (const_cast <void*> (p)) + i * page;
+  if (! n || ! QueryWorkingSetEx (GetCurrentProcess (), info.data (), static_cast <DWORD> (n * sizeof (info[0])))) return 0;
+  size_t m = 0;
+  for (size_t i = 0; i < n; ++i) m += info[i].VirtualAttributes.Valid;
+#else
+  if (FILE* fp = std::fopen ("/proc/self/smaps", "r")) { // Rss of the mapping
+    char line[256];
+    unsigned long start (0), end (0);
+    long rss (-1);
+    for (bool found = false; std::fgets (line, sizeof (line), fp); )
+      if (std::sscanf (line, "%lx-%lx", &start, &end) == 2) found = start == reinterpret_cast <unsigned long> (p);
+      else if (found && std::sscanf (line, "Rss: %ld", &rss) == 1) break;
+    std::fclose (fp);
+    if (rss >= 0) return static_cast <size_t> (rss) << 10;
+  }
+  const size_t page = sysconf (_SC_PAGESIZE), n = (size + page - 1) / page; // in page cache
+  std::vector <unsigned char> vec (n);
+  if (! n || mincore (const_cast <void*> (p), size, vec.data ()) != 0) return 0;
+  size_t m = 0;
+  for (size_t i = 0; i < n; ++i) m += vec[i] & 1;
+#endif
+  return m * page;
+}
+
+// bit widths packed in the model; compile variants with -DJAGGER_KEY_BITS=..
+// (train_jagger reports the tightest widths for a model)
+#ifndef JAGGER_KEY_BITS
+#define JAGGER_KEY_BITS 14
+#endif
+#ifndef JAGGER_PATTERN_BITS
+#define JAGGER_PATTERN_BITS 7
+#endif
+#ifndef JAGGER_FEATURE_BITS
+#define JAGGER_FEATURE_BITS 9
+#endif
+
+static const size_t MAX_KEY_BITS     = JAGGER_KEY_BITS; // also max POS ID
 
 // compute length of UTF8 character from its first byte
 // find UTF8 length from its first byte
@@ -71,31 +426,78 @@ static inline int unicode (const char* p, int& b) { // decode
   if ((p0 & 0xf0) == 0xe0) { b = 3; return ((p0 & 0xf) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f); }
   if (p0 < 0x80)           { b = 1; return p0; }
   if ((p0 & 0xe0) == 0xc0) { b = 2; return ((p0 & 0x1f) << 6) | (p[1] & 0x3f); }
+  if (p0 < 0xc0)           { b = 1; return 0; } // stray continuation byte (as u8_len)
   b = 4;
-  return ((p0 & 0x7) << 18) | ((p[1] & 0x3f) << 12) | ((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+  const int cp = ((p0 & 0x7) << 18) | ((p[1] & 0x3f) << 12) | ((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+  return cp > 0x10ffff ? 0 : cp; // invalid UTF-8 (e.g., 0xf5- leads)
+}
+
+// fold a code point to its NFKC form when that is a single character of the
+// other width (full-width ASCII, half-width katakana, ideographic space)
+static inline int fold_width (const int cp) {
+  static const uint16_t hw[] = { // U+FF61 - U+FF9F
+    0x3002, 0x300c, 0x300d, 0x3001, 0x30fb, 0x30f2, 0x30a1, 0x30a3, 0x30a5, 0x30a7, 0x30a9, 0x30e3, 0x30e5, 0x30e7, 0x30c3, 0x30fc,
+    0x30a2, 0x30a4, 0x30a6, 0x30a8, 0x30aa, 0x30ab, 0x30ad, 0x30af, 0x30b1, 0x30b3, 0x30b5, 0x30b7, 0x30b9, 0x30bb, 0x30bd, 0x30bf,
+    0x30c1, 0x30c4, 0x30c6, 0x30c8, 0x30ca, 0x30cb, 0x30cc, 0x30cd, 0x30ce, 0x30cf, 0x30d2, 0x30d5, 0x30d8, 0x30db, 0x30de, 0x30df,
+    0x30e0, 0x30e1, 0x30e2, 0x30e4, 0x30e6, 0x30e8, 0x30e9, 0x30ea, 0x30eb, 0x30ec, 0x30ed, 0x30ef, 0x30f3, 0x3099, 0x309a };
+  static const uint16_t fw[] = { 0x00a2, 0x00a3, 0x00ac, 0xffe3, 0x00a6, 0x00a5, 0x20a9 }; // U+FFE0 - U+FFE6
+  if (cp >= 0xff01 && cp <= 0xff5e) return cp - 0xfee0;
+  if (cp >= 0xff61 && cp <= 0xff9f) return hw[cp - 0xff61];
+  if (cp >= 0xffe0 && cp <= 0xffe6) return fw[cp - 0xffe0];
+  return cp == 0x3000 ? 0x20 : cp;
+}
+
+// FNV-1a hash of bytes
+static inline uint64_t fnv1a (const char* p, const size_t len, uint64_t h = 0xcbf29ce484222325ULL) {
+  for (size_t i = 0; i < len; ++i)
+    h = (h ^ static_cast <unsigned char> (p[i])) * 0x100000001b3ULL;
+  return h;
 }
 
 namespace jagger {
   static const size_t BUF_SIZE = 1 << 17;
   static const size_t CP_MAX   = 0x10ffff;  // limit of unicode code point
-  static const size_t MAX_PATTERN_BITS = 7; // bits of pattern length (surface)
-  static const size_t MAX_FEATURE_BITS = 9; // bits of feature string
+  static const size_t MAX_PATTERN_BITS = JAGGER_PATTERN_BITS; // bits of pattern length (surface)
+  static const size_t MAX_FEATURE_BITS = JAGGER_FEATURE_BITS; // bits of feature string
+  static const size_t MAX_ID_BITS      = 27 - MAX_PATTERN_BITS; // bits of pattern id
   enum { NUM = 1 << 0, ALPHA = 1 << 1, KANA = 1 << 2, OTHER = 0, ANY = 7 };
   struct feat_info_t { // feature infomation retrieved via value id
     uint32_t ti            : MAX_KEY_BITS;     // 14
     uint32_t core_feat_len : MAX_FEATURE_BITS; //  9 (anyway needed for unk word)
-    uint32_t feat_len      : MAX_FEATURE_BITS; //  9 (lex only for compact)
-    IF_COMPACT (uint32_t core_feat_offset : 18);
-    uint32_t feat_offset   : 28; // (lex only for compact)
+    uint32_t feat_len      : MAX_FEATURE_BITS; //  9 (lex)
+    uint32_t core_feat_offset : 18; // each distinct POS (core) is stored once
+    uint32_t feat_offset   : 28; // (lex)
+  };
+  union token_t { // pattern value stored in the trie
+    struct { uint32_t shift : MAX_PATTERN_BITS, ctype : 4, id : MAX_ID_BITS; bool concat : 1; };
+    int r;
   };
+  struct model_header_t { // m + ".hdr"; bit widths the model is compiled with
+    char magic[8];
+    uint32_t key_bits, pattern_bits, feature_bits, compact; // compact: 1 (core / lex split)
+    uint64_t hash[7]; // FNV-1a of MODEL_FILES and of these hashes (model id)
+  };
+  static const char* const MODEL_FILES[] = { ".da", ".c2i", ".p2f", ".fs", ".cnt", ".wda", 0 };
+  static inline model_header_t model_header () { // of this build
+    model_header_t h = { { 'j', 'a', 'g', 'g', 'e', 'r', '1', '\0' }, MAX_KEY_BITS, MAX_PATTERN_BITS, MAX_FEATURE_BITS, 1 };
+    return h;
+  }
+  struct word_t { // word in batch output
+    uint32_t begin, len;  // bytes in its input
+    uint32_t id     : 31; // pattern id (POS id for segmentation)
+    uint32_t concat : 1;  // as unknown words
+  };
+  static_assert (MAX_PATTERN_BITS + 1 + 4 <= 32 && ANY < (1 << 4), "pat_info_t packs shift and ctype in 32 bits");
   struct pat_info_t {
     std::string surf; // surface
     int ti_prev;      // prev pos id
     int count;
-    union { int r; struct { uint32_t shift : 8, ctype : 4, fi : 20; }; };
-    pat_info_t (const std::string &surf_, int ti_prev_, int count_, int shift_, int ctype_, int fi_) : surf (surf_), ti_prev (ti_prev_), count (count_), r (0) { shift = shift_, ctype = ctype_, fi = fi_; }
+    uint32_t shift : MAX_PATTERN_BITS + 1, ctype : 4; // + 1: overflow is caught below
+    int fi;           // feature id (full; not the packed one)
+    pat_info_t (const std::string &surf_, int ti_prev_, int count_, int shift_, int ctype_, int fi_) : surf (surf_), ti_prev (ti_prev_), count (count_), shift (shift_), ctype (ctype_), fi (fi_)
+    { ERR_IF (shift != static_cast <uint32_t> (shift_), "rebuild with larger -DJAGGER_PATTERN_BITS for shift %d", shift_); }
     bool operator< (const pat_info_t& a) const
-    { return count < a.count || (count == a.count && surf < a.surf); }
+    { return count < a.count || (count == a.count && (surf < a.surf || (surf == a.surf && ti_prev < a.ti_prev))); } // total
     template <typename T>
     void print (FILE* writer, const T& tbag, const T& fbag) const
     { std::fprintf (writer, "%d\t%s%s\t%d\t%d%s", count, surf.c_str (), ti_prev == -1 ? "\t" : tbag.to_s (ti_prev).c_str (), shift, ctype, fbag.to_s (fi).c_str ()); }
@@ -117,10 +519,11 @@ namespace jagger {
     iter begin () { return _key2id.begin (); }
     iter end   () { return _key2id.end (); }
     iter find (const T& s) { return _key2id.find (s); }
+    // write keys in id order; fp = 0 only computes offsets and size
     size_t serialize (FILE* fp, std::vector <size_t>& offsets, size_t size = 0) const {
       for (typename std::vector <const T*>::const_iterator it = _id2key.begin (); it != _id2key.end (); ++it) {
         offsets.push_back (size);
-        size += std::fwrite ((*it)->c_str (), sizeof (char), (*it)->size(), fp);
+        size += fp ? std::fwrite ((*it)->c_str (), sizeof (char), (*it)->size (), fp) : (*it)->size ();
       }
       return size;
     }
@@ -128,35 +531,195 @@ namespace jagger {
     std::map <T, int>      _key2id;
     std::vector <const T*> _id2key;
   };
+  static const size_t WIDE_SIZE = 16; // slack of buffers for wide copy
   class simple_reader {
   private:
-    char _buf[BUF_SIZE], *_p, *_q, * const _end;
+    char _buf[BUF_SIZE + WIDE_SIZE], *_p, *_q, * const _end;
+    const int _fd;
   public:
-    simple_reader () : _buf (), _p (_buf), _q (_p), _end (_buf + BUF_SIZE) { read (); }
+    simple_reader (const int fd = 0) : _buf (), _p (_buf), _q (_p), _end (_buf + BUF_SIZE), _fd (fd) { read (); }
     void read () {
       std::memmove (_buf, _p, _q - _p);
       _q -= _p - _buf;
       _p = _buf;
-      _q += ::read (0, _q, _end - _q);
+      _q += ::read (_fd, _q, _end - _q);
+      std::memset (_q, 0, WIDE_SIZE); // no stale bytes after input
     }
     const char* ptr () const { return _p; }
     const char* const end () const { return _q; }
     bool eob () const { return _p == _q; }
     void advance (const int shift) { _p += shift; }
     bool readable (const size_t min) const { return _p + min <= _q; }
+    bool full () const { return _p == _buf && _q == _end; }
+    const char* line () { // read until a line (or full buffer) is in; return its end
+      for (size_t len (0); ; ) {
+        if (const void* q = std::memchr (_p + len, '\n', _q - _p - len)) return static_cast <const char*> (q);
+        len = static_cast <size_t> (_q - _p);
+        if (full ()) return _q;
+        read ();
+        if (_p + len == _q) return _q; // EOF
+      }
+    }
   };
   class simple_writer {
   private:
-    char _buf[BUF_SIZE], *_p, * const _end;
+    char _buf[BUF_SIZE + WIDE_SIZE], *_p, * const _end;
+    const int _fd;
+    std::string* _s; // sink instead of fd
   public:
-    simple_writer () : _buf (), _p (_buf), _end (_buf + BUF_SIZE) {}
+    simple_writer (const int fd = 1, std::string* s = 0) : _buf (), _p (_buf), _end (_buf + BUF_SIZE), _fd (fd), _s (s) {}
+    explicit simple_writer (std::string& s) : _buf (), _p (_buf), _end (_buf + BUF_SIZE), _fd (-1), _s (&s) {}
     ~simple_writer () { flush (); }
     bool writable (const size_t min) const { return _p + min <= _end; }
-    void flush () { _p -= ::write (1, _buf, static_cast <size_t> (_p - _buf)); }
+    const char* ptr () const { return _p; }
+    size_t size () const { return (_s ? _s->size () : 0) + static_cast <size_t> (_p - _buf); } // for string sink
+    void flush () {
+      if (_s) _s->append (_buf, _p), _p = _buf;
+      else _p -= ::write (_fd, _buf, static_cast <size_t> (_p - _buf));
+    }
     void write (const char* s, const size_t len) {
       std::memcpy (_p, s, len);
       _p += len;
     }
+    void write_wide (const char* s, const size_t len) { // s must have slack
+      for (size_t i = 0; i < len; i += WIDE_SIZE) std::memcpy (_p + i, s + i, WIDE_SIZE);
+      _p += len;
+    }
+  };
+  class sentence_cache { // bounded cache of tagged lines with CLOCK eviction
+  private:
+    struct entry_t { uint64_t hash; std::string line, output; bool ref; };
+    std::vector <entry_t> _entry;
+    std::unordered_map <uint64_t, size_t> _h2i; // hash of line -> entry
+    const size_t _capacity, _max_len;
+    size_t _hand;
+    uint64_t _lookup, _hit;
+  public:
+    sentence_cache (const size_t capacity, const size_t max_len = 1 << 12) : _entry (), _h2i (), _capacity (capacity), _max_len (max_len), _hand (0), _lookup (0), _hit (0) {}
+    size_t max_len () const { return _max_len; }
+    uint64_t lookup () const { return _lookup; }
+    uint64_t hit () const { return _hit; }
+    const std::string* find (const char* p, const size_t len) {
+      ++_lookup;
+      std::unordered_map <uint64_t, size_t>::const_iterator it = _h2i.find (fnv1a (p, len));
+      if (it == _h2i.end ()) return 0;
+      entry_t& e = _entry[it->second];
+      if (e.line.size () != len || std::memcmp (e.line.data (), p, len) != 0) return 0; // collision
+      e.ref = true;
+      ++_hit;
+      return &e.output;
+    }
+    void insert (const char* p, const size_t len, const char* out, const size_t olen) {
+      if (! _capacity || len > _max_len) return;
+      const uint64_t hash = fnv1a (p, len);
+      std::unordered_map <uint64_t, size_t>::iterator it = _h2i.find (hash);
+      size_t i = 0;
+      if (it != _h2i.end ()) // replace colliding line
+        i = it->second;
+      else if (_entry.size () < _capacity)
+        i = _entry.size (), _entry.push_back (entry_t ());
+      else { // evict the first unreferenced entry
+        for (; _entry[_hand].ref; _hand = (_hand + 1) % _capacity)
+          _entry[_hand].ref = false;
+        i = _hand;
+        _hand = (_hand + 1) % _capacity;
+        _h2i.erase (_entry[i].hash);
+      }
+      entry_t& e = _entry[i];
+      e.hash = hash;
+      e.line.assign (p, len);
+      e.output.assign (out, olen);
+      e.ref = false;
+      _h2i[hash] = i;
+    }
+  };
+  class postings { // distinct terms of a document and their occurrences
+  private:
+    std::unordered_map <std::string, size_t> _t2i;
+    std::vector <std::string> _term;
+    std::vector <std::vector <uint64_t> > _occ; // term -> <position, begin, length>*
+    uint64_t _pos;
+    static void _write_varint (simple_writer& writer, uint64_t v) {
+      char buf[10], *p = buf;
+      for (; v >= 0x80; v >>= 7) *p++ = static_cast <char> (v | 0x80);
+      *p++ = static_cast <char> (v);
+      writer.write (buf, p - buf);
+    }
+  public:
+    postings () : _t2i (), _term (), _occ (), _pos (0) {}
+    void add (const std::string& term, const size_t begin, const size_t len) {
+      std::pair <std::unordered_map <std::string, size_t>::iterator, bool> it = _t2i.insert (std::make_pair (term, _term.size ()));
+      if (it.second) _term.push_back (term), _occ.push_back (std::vector <uint64_t> ());
+      std::vector <uint64_t>& occ = _occ[it.first->second];
+      occ.push_back (_pos++);
+      occ.push_back (begin);
+      occ.push_back (len);
+    }
+    // <#terms> (<len> <term> <#occ> (<d(position)> <d(begin)> <length>)*)* in varints
+    void write (simple_writer& writer) {
+      if (! writer.writable (10)) writer.flush ();
+      _write_varint (writer, _term.size ());
+      for (size_t i = 0; i < _term.size (); ++i) {
+        const std::string& t = _term[i];
+        for (size_t j = 0; j <= t.size (); j += BUF_SIZE / 2) {
+          if (! writer.writable (BUF_SIZE / 2 + 20)) writer.flush ();
+          if (j == 0) _write_varint (writer, t.size ());
+          writer.write (t.data () + j, std::min (t.size () - j, BUF_SIZE / 2));
+        }
+        const std::vector <uint64_t>& occ = _occ[i];
+        _write_varint (writer, occ.size () / 3);
+        for (size_t j (0), pos (0), begin (0); j < occ.size (); pos = occ[j], begin = occ[j + 1], j += 3) {
+          if (! writer.writable (30)) writer.flush ();
+          _write_varint (writer, occ[j] - pos);
+          _write_varint (writer, occ[j + 1] - begin);
+          _write_varint (writer, occ[j + 2]);
+        }
+      }
+      _t2i.clear ();
+      _term.clear ();
+      _occ.clear ();
+      _pos = 0;
+    }
+  };
+  class mapped_file { // read-only view of a file
+  private:
+    char* _data;
+    size_t _size;
+    mapped_file (const mapped_file&);
+    mapped_file& operator= (const mapped_file&);
+  public:
+    explicit mapped_file (const std::string& fn) : _data (0), _size (0) {
+      int fd = __open (fn.c_str (), O_RDONLY);
+      ERR_IF (fd == -1, "cannot read from %s", fn.c_str ());
+      _size = __lseek (fd, 0, SEEK_END);
+      if (_size) _data = static_cast <char*> (_mmap (0, _size, PROT_READ, MAP_SHARED, fd, 0));
+      _close (fd);
+      ERR_IF (_size && (! _data || _data == MAP_FAILED), "cannot map %s", fn.c_str ());
+    }
+    ~mapped_file () { if (_size) _munmap (_data, _size); }
+    const char* begin () const { return _data; }
+    const char* end () const { return _data + _size; }
+  };
+  static inline void hash_model (const std::string& m, uint64_t* hash) { // see model_header_t
+    size_t i = 0;
+    for (; MODEL_FILES[i]; ++i) {
+      const mapped_file file (m + MODEL_FILES[i]);
+      hash[i] = fnv1a (file.begin (), file.end () - file.begin ());
+    }
+    hash[i] = fnv1a (reinterpret_cast <const char*> (hash), i * sizeof (uint64_t));
+  }
+  class line_scanner { // yield lines [line, eol) (eol after '\n') without copy
+  private:
+    const char *_p, * const _end;
+  public:
+    line_scanner (const char* p, const char* end) : _p (p), _end (end) {}
+    bool next (const char*& line, const char*& eol) {
+      if (_p == _end) return false;
+      const void* q = std::memchr (_p, '\n', _end - _p);
+      line = _p;
+      _p = eol = q ? static_cast <const char*> (q) + 1 : _end;
+      return true;
+    }
   };
 }
 
@@ -170,7 +733,7 @@ namespace ccedar {
       void advance (const int b) { p += b; }
     };
     FORCE_INLINE
-    int longestPatternSearch (const char* key, const char* const end, int fi_prev, const uint16_t* const c2i, size_t from = 0) const {
+    int longestPatternSearch (const char* key, const char* const end, int fi_prev, const uint16_t* const c2i, size_t from = 0, size_t* slot = 0) const { // slot: node holding the value (as .cnt)
       size_t from_ (0), pos (0);
       int n (0), i (0), b (0);
       for (u8_feeder f (key, end); (i = c2i[f.read (b)]); f.advance (b)) {
@@ -181,14 +744,991 @@ namespace ccedar {
         n = n_;
       }
       // ad-hock matching at the moment; it prefers POS-ending patterns
-      if (! fi_prev) return n;
       const node* const array_ = array ();
+      if (! fi_prev) {
+        if (slot) *slot = n ? static_cast <size_t> (array_[from_].base) : 0;
+        return n;
+      }
       for (size_t from__ (0); ; from = array_[from].check) { // hopefully, in the cache
         const int n_ = traverse (&fi_prev, from__ = from, pos = 0, 1);
-        if (n_ != NO_VALUE && n_ != NO_PATH) return n_;
-        if (from == from_)  return n;
+        if (n_ != NO_VALUE && n_ != NO_PATH) {
+          if (slot) *slot = static_cast <size_t> (array_[from__].base);
+          return n_;
+        }
+        if (from == from_) {
+          if (slot) *slot = n ? static_cast <size_t> (array_[from_].base) : 0;
+          return n;
+        }
+      }
+    }
+    // enumerate all patterns <value, node> matching prefixes of key, including
+    // those ending with fi_prev; result must hold 2 * (1 << MAX_PATTERN_BITS) + 1
+    size_t commonPatternSearch (const char* key, const char* const end, int fi_prev, const uint16_t* const c2i, std::pair <int, size_t>* result) const {
+      const node* const array_ = array ();
+      size_t from (0), pos (0), num (0);
+      int i (0), b (0);
+      for (u8_feeder f (key, end); ; f.advance (b)) {
+        size_t from_ (from);
+        const int n_ = fi_prev ? traverse (&fi_prev, from_, pos = 0, 1) : NO_PATH;
+        if (n_ >= 0) result[num++] = std::make_pair (n_, static_cast <size_t> (array_[from_].base));
+        if (! (i = c2i[f.read (b)])) break;
+        const int n = traverse (&i, from, pos = 0, 1);
+        if (n == NO_PATH) break;
+        if (n >= 0) result[num++] = std::make_pair (n, static_cast <size_t> (array_[from].base));
+      }
+      return num;
+    }
+    // replace pattern ids in values with POS ids for segmentation
+    static void fold_values (node* array_, const size_t size, const jagger::feat_info_t* const p2f) {
+      for (size_t i = 1; i < size; ++i)
+        if (array_[i].check >= 0 && array_[array_[i].check].base == static_cast <int> (i)) { // label 0
+          jagger::token_t s = { };
+          s.r = array_[i].value;
+          s.id = p2f[s.id].ti;
+          array_[i].value = s.r;
+        }
+    }
+  };
+}
+
+namespace jagger {
+  class tagger {
+  private:
+    ccedar::da_  _da;  // there may be cache friendly alignment
+    uint16_t*    _c2i; // UTF8 char and BOS -> id
+    feat_info_t* _p2f; // pattern id -> feature (info)
+    char*        _fs;  // feature strings
+    size_t       _fs_wide; // features ending before this can be copied wide
+    uint32_t*    _cnt; // trie node -> pattern count (lattice)
+    std::vector <std::pair <void*, size_t> > _mmaped;
+    std::vector <ccedar::da_::node> _wda; // trie for segmentation (old models)
+    std::vector <uint16_t> _nc2i; // c2i with normalization folded in
+    bool         _fold; // shift of patterns count bytes of folded chars
+    bool         _local; // _mmaped holds node-local replicas
+    int          _node; // NUMA node of the replicas (-1 if none)
+    std::vector <const tagger*> _workers; // taggers with replicas on each node
+    model_header_t _header;
+    size_t       _max_resident; // trim model pages beyond this
+    mutable std::atomic <int64_t> _trim_msec; // last check of trim_if_over ()
+    mutable std::atomic <size_t>  _trim_rss;  // resident bytes after the last trim
+    void* _read_array (const std::string& fn, const bool required = true) {
+      int fd = __open(fn.c_str (), O_RDONLY);
+      if (fd == -1 && ! required) return 0;
+      ERR_IF (fd == -1, "no such file: %s", fn.c_str ());
+      const size_t size = __lseek(fd, 0, SEEK_END); // get size
+      __lseek(fd, 0, SEEK_SET);
+      void *data = _mmap (0, size, PROT_READ, MAP_SHARED, fd, 0);
+      _close (fd);
+      _mmaped.push_back (std::make_pair (data, size));
+      return data;
+    }
+  public:
+    tagger () : _da (), _c2i (0), _p2f (0), _fs (0), _fs_wide (0), _cnt (0), _mmaped (), _wda (), _nc2i (), _fold (false), _local (false), _node (-1), _workers (), _header (), _max_resident (0), _trim_msec (0), _trim_rss (0) {}
+    ~tagger () {
+      for (size_t i = 0; i < _mmaped.size (); ++i)
+        if (_local)
+          free_on_node (_mmaped[i].first, _mmaped[i].second);
+        else
+          _munmap (_mmaped[i].first, _mmaped[i].second);
+    }
+    // copy the read-only model to memory local to the NUMA node; call this
+    // from a thread bound to the node so that tagging reads the local copy
+    void replicate (const int node) {
+      if (! _wda.empty ()) { // treat the private trie / c2i as other sections
+        _mmaped.push_back (std::make_pair (static_cast <void*> (_wda.data ()), _wda.size () * sizeof (ccedar::da_::node)));
+        _local = true; // skip munmap in case of failure
+      }
+      if (! _nc2i.empty ()) {
+        _mmaped.push_back (std::make_pair (static_cast <void*> (_nc2i.data ()), _nc2i.size () * sizeof (uint16_t)));
+        _local = true;
+      }
+      size_t size = 0;
+      for (size_t i = 0; i < _mmaped.size (); ++i) {
+        void* const p = _mmaped[i].first, * const q = alloc_on_node (_mmaped[i].second, node);
+        ERR_IF (! q, "cannot allocate %ld bytes on node %d", static_cast <long> (_mmaped[i].second), node);
+        std::memcpy (q, p, _mmaped[i].second); // first touch
+        if (p == _da.array ()) _da.set_array (q);
+        if (p == _c2i) _c2i = static_cast <uint16_t*> (q);
+        if (p == _p2f) _p2f = static_cast <feat_info_t*> (q);
+        if (p == _fs)  _fs  = static_cast <char*> (q);
+        if (p == _cnt) _cnt = static_cast <uint32_t*> (q);
+        if (p != _wda.data () && p != _nc2i.data ()) _munmap (p, _mmaped[i].second);
+        _mmaped[i].first = q;
+        size += _mmaped[i].second;
+      }
+      std::vector <ccedar::da_::node> ().swap (_wda);
+      std::vector <uint16_t> ().swap (_nc2i);
+      _local = true;
+      _node = node;
+      std::fprintf (stderr, "numa: %ld bytes replicated to node %d of %d; placed on", static_cast <long> (size), node, numa_nodes ());
+      for (size_t i = 0; i < _mmaped.size (); ++i)
+        std::fprintf (stderr, " %d", node_of (_mmaped[i].first));
+      std::fprintf (stderr, "\n");
+    }
+    // drop model pages from memory (page cache keeps them for re-reading)
+    void trim () const {
+      if (_local) return; // private copies cannot be re-read
+      for (size_t i = 0; i < _mmaped.size (); ++i)
+        drop_pages (_mmaped[i].first, _mmaped[i].second);
+    }
+    void trim_over (const size_t max_resident) { _max_resident = max_resident; }
+    // trim () when the process uses more than max_resident bytes; called on
+    // every input refill, but checks at most once a second (by one thread)
+    // and trims again only after the process grew by 1/8 of max_resident
+    void trim_if_over () const {
+      if (! _max_resident) return;
+      const int64_t now = std::chrono::duration_cast <std::chrono::milliseconds> (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+      int64_t last = _trim_msec;
+      if (now - last < 1000 || ! _trim_msec.compare_exchange_strong (last, now)) return;
+      const size_t rss = resident_bytes ();
+      if (rss <= _max_resident || rss <= _trim_rss + _max_resident / 8) return;
+      trim ();
+      _trim_rss = resident_bytes ();
+    }
+    // pin the calling (worker) thread to the node of the replicas, if any
+    void bind () const { if (_node >= 0) bind_to_node (_node); }
+    // let parallel workers tag with these taggers (e.g., one replicated to
+    // each NUMA node); worker i uses workers[i % workers.size ()]
+    void spread (const std::vector <const tagger*>& workers) { _workers = workers; }
+    const tagger& worker (const size_t i) const
+    { return _workers.empty () ? *this : *_workers[i % _workers.size ()]; }
+    void report_residency () const {
+      std::fprintf (stderr, "resident:");
+      for (size_t i = 0; i < _mmaped.size (); ++i) {
+        const void* p = _mmaped[i].first;
+        std::fprintf (stderr, " %s %ld/%ldKB", p == _da.array () ? "trie" : p == _c2i ? "c2i" : p == _p2f ? "p2f" : p == _fs ? "fs" : p == _cnt ? "cnt" : "unused",
+                      static_cast <long> (resident_size (p, _mmaped[i].second) >> 10), static_cast <long> (_mmaped[i].second >> 10));
+      }
+      std::fprintf (stderr, "; process %ldKB\n", static_cast <long> (resident_bytes () >> 10));
+    }
+    void warmup () const { // fault in model pages to avoid cold start
+      for (size_t i = 0; i < _mmaped.size (); ++i)
+        prefault (_mmaped[i].first, _mmaped[i].second);
+    }
+    // keep all model files resident for taggers in other processes mapping
+    // the same files (never returns)
+    void keep_resident (const std::string& m, const unsigned interval = 60) {
+      static const char* ext[] = { ".da", ".wda", ".c2i", ".p2f", ".fs", ".cnt", 0 };
+      for (size_t i = 0; ext[i]; ++i) _read_array (m + ext[i], false);
+      size_t size = 0;
+      for (size_t i = 0; i < _mmaped.size (); ++i) {
+        size += _mmaped[i].second;
+        if (! lock_pages (_mmaped[i].first, _mmaped[i].second))
+          std::fprintf (stderr, "warning: cannot lock pages; re-touch them every %u sec.\n", interval);
+      }
+      std::fprintf (stderr, "keeping %ld bytes of %s resident.\n", static_cast <long> (size), m.c_str ());
+      for (;;) {
+        warmup ();
+#ifdef _WIN32
+        Sleep (interval * 1000);
+#else
+        sleep (interval);
+#endif
+      }
+    }
+    void read_model (const std::string& m, const bool tagging = true, const bool lattice = false) { // read patterns
+      _read_header (m);
+      _c2i = static_cast <uint16_t*> (_read_array (m + ".c2i"));
+      if (tagging) {
+        _da.set_array (_read_array (m + ".da"));
+        _p2f = static_cast <feat_info_t*> (_read_array (m + ".p2f"));
+        _fs  = static_cast <char*> (_read_array (m + ".fs"));
+        _fs_wide = _mmaped.back ().second - std::min (_mmaped.back ().second, WIDE_SIZE); // padded since .hdr
+        if (lattice) _cnt = static_cast <uint32_t*> (_read_array (m + ".cnt"));
+      } else if (void* wda = _read_array (m + ".wda", false)) { // segmentation only
+        _da.set_array (wda);
+      } else { // fold .p2f into a private copy of .da
+        const ccedar::da_::node* da = static_cast <ccedar::da_::node*> (_read_array (m + ".da"));
+        _wda.assign (da, da + _mmaped.back ().second / sizeof (ccedar::da_::node));
+        ccedar::da_::fold_values (_wda.data (), _wda.size (), static_cast <feat_info_t*> (_read_array (m + ".p2f")));
+        _da.set_array (_wda.data ());
+      }
+    }
+    // fold characters into their NFKC (width) forms known to the model while
+    // mapping them to ids; surfaces and offsets still come from input bytes
+    void normalize () {
+      std::vector <uint16_t> c2i (_c2i, _c2i + CP_MAX + 2);
+      for (int cp = 0; cp <= static_cast <int> (CP_MAX); ++cp) {
+        const int to = fold_width (cp);
+        if (to != cp && ! _c2i[cp] && _c2i[to]) c2i[cp] = _c2i[to]; // unless known as is
+      }
+      _nc2i.swap (c2i);
+      _c2i = _nc2i.data ();
+      _fold = true;
+    }
+    // bytes of input a search may read; with normalize (), a pattern byte may
+    // match up to three input bytes (e.g., full-width ASCII)
+    size_t lookahead () const { return (static_cast <size_t> (1) << MAX_PATTERN_BITS) * (_fold ? 3 : 1) + 4; }
+    // bytes a step () or finish () may write: surface, core + lex features
+    // (each up to 2^MAX_FEATURE_BITS), and the slack of a wide copy
+    size_t max_step_bytes () const { return (static_cast <size_t> (2) << MAX_FEATURE_BITS) + lookahead () + WIDE_SIZE; }
+    void write_feature (simple_writer& writer, const bool concat, const feat_info_t finfo) const {
+      _write_fs (writer, finfo.core_feat_offset, finfo.core_feat_len);
+      if (concat) // as unknown words
+        writer.write_wide (",*,*,*\n\0\0\0\0\0\0\0\0", 7); // padded
+      else
+        _write_fs (writer, finfo.feat_offset, finfo.feat_len);
+    }
+    // tag from p (a newline or a pattern); return the number of bytes consumed;
+    // [p, end) must hold lookahead () bytes unless at the end
+    template <const bool TAGGING>
+    int step (const char* p, const char* const end, token_t& s_prev, feat_info_t& finfo, simple_writer& writer) const {
+      if (*p == '\n') { // EOS
+        if (s_prev.r)
+          if (TAGGING) write_feature (writer, s_prev.concat, finfo);
+        writer.write (TAGGING ? "EOS\n" : "\n", TAGGING ? 4 : 1);
+        s_prev.r = 0; // *
+        finfo.ti = _c2i[CP_MAX + 1]; // BOS
+        return 1;
+      }
+      token_t s = {};
+      s.r = _da.longestPatternSearch (p, end, finfo.ti, _c2i);
+      const int shift = _shift (p, end, s);
+      if (s_prev.r && ! (s.concat = _concat (s_prev, s))) { // word that may concat with the future context
+        if (TAGGING)
+          write_feature (writer, s_prev.concat, finfo);
+        else
+          writer.write (" ", 1);
+      }
+      if (TAGGING) finfo = _p2f[s.id]; else finfo.ti = s.id; // POS id for -w
+      s_prev = s; // *
+      if (TAGGING) writer.write (p, shift); else writer.write_wide (p, shift);
+      return shift;
+    }
+    // tag n (short) strings at once; words of input i are stored in
+    // words[offsets[i], offsets[i + 1]); inputs are tagged in lanes by turns
+    // so that their independent trie lookups overlap; with cache, words of
+    // whole inputs are looked up in / stored to it (do not share it with
+    // run () etc., which store text)
+    template <const bool TAGGING>
+    void tag_batch (const std::pair <const char*, size_t>* inputs, const size_t n, std::vector <word_t>& words, std::vector <size_t>& offsets, sentence_cache* cache = 0) const {
+      if (cache) { // tag inputs not in cache as a batch, and merge
+        std::vector <const std::string*> hit (n, 0);
+        std::vector <std::pair <const char*, size_t> > miss;
+        for (size_t i = 0; i < n; ++i)
+          if (inputs[i].second > cache->max_len () || ! (hit[i] = cache->find (inputs[i].first, inputs[i].second)))
+            miss.push_back (inputs[i]);
+        std::vector <word_t> words_;
+        std::vector <size_t> offsets_;
+        tag_batch <TAGGING> (miss.data (), miss.size (), words_, offsets_);
+        words.clear ();
+        offsets.assign (1, 0);
+        for (size_t i (0), j (0); i < n; ++i) {
+          if (hit[i]) {
+            words.resize (words.size () + hit[i]->size () / sizeof (word_t));
+            if (! hit[i]->empty ()) std::memcpy (&words[offsets.back ()], hit[i]->data (), hit[i]->size ());
+          } else
+            words.insert (words.end (), words_.begin () + offsets_[j], words_.begin () + offsets_[j + 1]), ++j;
+          offsets.push_back (words.size ());
+        }
+        for (size_t i (0), j (0); i < n; ++i) // after merge; insert () may overwrite hits
+          if (! hit[i])
+            cache->insert (inputs[i].first, inputs[i].second, reinterpret_cast <const char*> (words_.data () + offsets_[j]), (offsets_[j + 1] - offsets_[j]) * sizeof (word_t)), ++j;
+        return;
+      }
+      static const size_t LANES = 4;
+      std::vector <size_t> pos (n + 1, 0); // a truncated char at the end reads slack, not the next input
+      for (size_t i = 0; i < n; ++i) pos[i + 1] = pos[i] + inputs[i].second + WIDE_SIZE;
+      std::vector <char> buf (pos[n], 0); // inputs, each followed by zero-filled slack
+      for (size_t i = 0; i < n; ++i)
+        if (inputs[i].second) std::memcpy (&buf[pos[i]], inputs[i].first, inputs[i].second);
+      words.clear ();
+      offsets.assign (1, 0);
+      std::vector <word_t> lane[LANES];
+      for (size_t i = 0; i < n; i += LANES) {
+        const size_t m = std::min (LANES, n - i);
+        const char *p[LANES], *end[LANES];
+        token_t s_prev[LANES];
+        int ti[LANES];
+        size_t live = 0;
+        for (size_t j = 0; j < m; ++j) {
+          p[j] = &buf[pos[i + j]], end[j] = p[j] + inputs[i + j].second;
+          s_prev[j].r = 0, ti[j] = _c2i[CP_MAX + 1]; // BOS
+          if (p[j] < end[j]) ++live;
+        }
+        while (live)
+          for (size_t j = 0; j < m; ++j)
+            if (p[j] < end[j]) {
+              _batch_step <TAGGING> (p[j], end[j], &buf[pos[i + j]], s_prev[j], ti[j], lane[j]);
+              if (p[j] == end[j]) --live;
+            }
+        for (size_t j = 0; j < m; ++j) {
+          words.insert (words.end (), lane[j].begin (), lane[j].end ());
+          offsets.push_back (words.size ());
+          lane[j].clear ();
+        }
+      }
+    }
+    // append features of w as in the output (w/o the leading tab and newline)
+    void feature (const word_t& w, std::string& ret) const {
+      const feat_info_t finfo = _p2f[w.id];
+      const size_t from = ret.size ();
+      ret.append (&_fs[finfo.core_feat_offset], finfo.core_feat_len);
+      if (w.concat) // as unknown words
+        ret.append (",*,*,*\n", 7);
+      else
+        ret.append (&_fs[finfo.feat_offset], finfo.feat_len);
+      ret.erase (from, 1);
+      ret.erase (ret.size () - 1);
+    }
+    template <const bool TAGGING>
+    void finish (token_t& s_prev, feat_info_t& finfo, simple_writer& writer) const { // close the last line
+      if (s_prev.r) {
+        if (TAGGING) write_feature (writer, s_prev.concat, finfo);
+        writer.write (TAGGING ? "EOS\n" : "\n", TAGGING ? 4 : 1);
+      }
+      s_prev.r = 0;
+      finfo.ti = _c2i[CP_MAX + 1]; // BOS
+    }
+    template <const bool TAGGING, const bool TTY>
+    void run (const int in = 0, const int out = 1) const {
+      token_t s_prev = {};
+      feat_info_t finfo = { _c2i[CP_MAX + 1] }; // BOS
+      simple_reader reader (in);
+      simple_writer writer (out);
+      for (;! reader.eob ();) {
+        const bool eos = *reader.ptr () == '\n';
+        reader.advance (step <TAGGING> (reader.ptr (), reader.end (), s_prev, finfo, writer));
+        if (TTY && eos) writer.flush (); // line buffering
+        if (! writer.writable (max_step_bytes ())) writer.flush ();
+        if (TTY && reader.eob ()) reader.read (), trim_if_over ();
+        if (! TTY && ! reader.readable (lookahead ())) reader.read (), trim_if_over ();
+      }
+      finish <TAGGING> (s_prev, finfo, writer);
+    }
+    // run () on input split into chunks tagged in parallel; each chunk is
+    // tagged from BOS, and joined where tagging from the previous chunk
+    // reaches a position with the same previous token (hence the same output
+    // after that), so that output is identical to run (); input is read in
+    // rounds of up to nthreads windows, so in-flight input is bounded by
+    // nthreads * window; chunks are at least min_chunk bytes, so small
+    // inputs use fewer threads
+    template <const bool TAGGING>
+    void run_parallel (const size_t nthreads, const int in = 0, const int out = 1, const size_t min_chunk = 1 << 12, size_t window = 1 << 24) const {
+      window = std::max (window, 2 * lookahead ()); // rounds must advance
+      const size_t cap = std::max (nthreads, size_t (1)) * window;
+      std::vector <char> buf; // grows up to cap as read
+      token_t s_prev = {};
+      feat_info_t finfo = { _c2i[CP_MAX + 1] }; // BOS
+      size_t len = 0; // unprocessed bytes carried over from the last round + read
+      for (bool eof = false; ! eof; ) {
+        for (long n = 0; len < cap; len += n) {
+          const size_t want = std::min (cap - len, BUF_SIZE);
+          if (buf.size () < len + want + WIDE_SIZE) buf.resize (len + want + WIDE_SIZE);
+          if ((n = ::read (in, &buf[len], want)) <= 0) break;
+        }
+        eof = len < cap;
+        if (buf.size () < len + WIDE_SIZE) buf.resize (len + WIDE_SIZE);
+        std::fill (&buf[len], &buf[len] + WIDE_SIZE, '\0'); // slack
+        // tag up to lim; bytes after lim are lookahead and carried over
+        const size_t lim = eof ? len : len - lookahead ();
+        const size_t p = _tag_round <TAGGING> (nthreads, buf.data (), len, lim, eof, min_chunk, s_prev, finfo, out);
+        std::memmove (&buf[0], &buf[p], len - p);
+        len -= p;
+      }
+    }
+    // tag a line [p, q] (*q == '\n') that starts after EOS with its output
+    // looked up in / stored to cache; return its length, or 0 (nothing done)
+    // if the line is too long or a broken char runs over q
+    template <const bool TAGGING>
+    size_t tag_line (sentence_cache& cache, const char* p, const char* q, const char* end, token_t& s_prev, feat_info_t& finfo, simple_writer& writer) const {
+      const size_t len = static_cast <size_t> (q - p) + 1;
+      if (len > cache.max_len () || _crosses (p, q)) return 0;
+      if (const std::string* r = cache.find (p, len)) {
+        if (! writer.writable (r->size ())) writer.flush ();
+        writer.write (r->data (), r->size ());
+      } else {
+        if (! writer.writable (BUF_SIZE / 2)) writer.flush ();
+        const char* const mark = writer.ptr ();
+        bool whole = true;
+        for (const char* r = p; r <= q; ) {
+          r += step <TAGGING> (r, end, s_prev, finfo, writer);
+          if (! writer.writable (max_step_bytes ())) writer.flush (), whole = false;
+        }
+        if (whole) cache.insert (p, len, mark, static_cast <size_t> (writer.ptr () - mark));
+      }
+      return len;
+    }
+    // run () with output of complete lines looked up in / stored to cache
+    template <const bool TAGGING, const bool TTY>
+    void run (sentence_cache& cache, const int in = 0, const int out = 1) const {
+      token_t s_prev = {};
+      feat_info_t finfo = { _c2i[CP_MAX + 1] }; // BOS
+      simple_reader reader (in);
+      simple_writer writer (out);
+      for (bool bol = true; ! reader.eob (); ) {
+        const char* const q = reader.line ();
+        size_t len = 0;
+        if (q != reader.end () && bol && (len = tag_line <TAGGING> (cache, reader.ptr (), q, reader.end (), s_prev, finfo, writer))) { // whole line
+          reader.advance (static_cast <int> (len));
+          if (TTY) writer.flush (); // line buffering
+          else if (! writer.writable (max_step_bytes ())) writer.flush ();
+        } else // part of a line; tag as run ()
+          do {
+            bol = *reader.ptr () == '\n';
+            reader.advance (step <TAGGING> (reader.ptr (), reader.end (), s_prev, finfo, writer));
+            if (TTY && bol) writer.flush (); // line buffering
+            if (! writer.writable (max_step_bytes ())) writer.flush ();
+          } while (! bol && reader.readable (lookahead ()));
+        if (TTY && reader.eob ()) reader.read (), trim_if_over ();
+        if (! TTY && ! reader.readable (lookahead ())) reader.read (), trim_if_over ();
+      }
+      finish <TAGGING> (s_prev, finfo, writer);
+    }
+    // write per-line postings of distinct terms (surface, or the field of
+    // features if it is not *) with positions and byte offsets in binary
+    template <const bool TAGGING>
+    void run_postings (const int field = -1, const int in = 0, const int out = 1) const {
+      token_t s_prev = {};
+      feat_info_t finfo = { _c2i[CP_MAX + 1] }; // BOS
+      simple_reader reader (in);
+      simple_writer writer (out);
+      postings doc;
+      std::string surf, buf; // current token
+      size_t offset (0), begin (0); // in line
+      for (; ! reader.eob (); ) {
+        const char* const p = reader.ptr ();
+        int shift = 1;
+        if (*p == '\n') { // EOS
+          if (s_prev.r) doc.add (_term (surf, s_prev.concat, finfo, field, buf), begin, offset - begin);
+          doc.write (writer);
+          s_prev.r = 0;
+          finfo.ti = _c2i[CP_MAX + 1]; // BOS
+          surf.clear ();
+          offset = begin = 0;
+        } else {
+          token_t s = {};
+          s.r = _da.longestPatternSearch (p, reader.end (), finfo.ti, _c2i);
+          shift = _shift (p, reader.end (), s);
+          if (s_prev.r && ! (s.concat = _concat (s_prev, s))) {
+            doc.add (_term (surf, s_prev.concat, finfo, field, buf), begin, offset - begin);
+            surf.clear ();
+            begin = offset;
+          }
+          if (TAGGING) finfo = _p2f[s.id]; else finfo.ti = s.id;
+          s_prev = s;
+          surf.append (p, shift);
+          offset += shift;
+        }
+        reader.advance (shift);
+        if (! reader.readable (lookahead ())) reader.read (), trim_if_over ();
+      }
+      if (s_prev.r) {
+        doc.add (_term (surf, s_prev.concat, finfo, field, buf), begin, offset - begin);
+        doc.write (writer);
+      }
+    }
+    // print lattice of patterns: <begin> <end> <greedy?> <count> <surface> <feature>;
+    // edges start from positions reachable from BOS, k best (by count) per position;
+    // greedy edges are the tokens jagger outputs: patterns it concatenates as an
+    // unknown word (e.g., katakana, digits) are joined into one greedy edge, and
+    // the patterns themselves are listed as non-greedy edges
+    template <const bool TTY>
+    void run_lattice (const size_t k, const int in = 0, const int out = 1) const {
+      const size_t la = lookahead ();
+      std::pair <int, size_t> match[2 * (1 << MAX_PATTERN_BITS) + 1];
+      std::pair <uint32_t, int> edge[2 * (1 << MAX_PATTERN_BITS) + 1]; // <count, value>
+      std::vector <std::pair <int, int64_t> > ctx; // position -> <POS id, count of incoming edge>
+      std::vector <char> on_path; // greedy path
+      std::vector <int> seen; // values output at a position
+      run_t run = {}; // greedy edges to be joined
+      std::string held; // edges after the start of run
+      simple_reader reader (in);
+      simple_writer writer (out), hwriter (held);
+      for (size_t base = 0; ! reader.eob (); ) { // base: offset of ptr () in a line
+        const char* const q = reader.line (), * const p = reader.ptr ();
+        const size_t len = static_cast <size_t> (q - p);
+        const bool cont = reader.full () && len > la; // line longer than buffer
+        const size_t lim = cont ? len - la : len; // positions to expand now
+        if (! base) { // reuse per-sentence arena
+          ctx.assign (len + 1, std::make_pair (-1, int64_t (-1)));
+          on_path.assign (len + 1, 0);
+          ctx[0].first = _c2i[CP_MAX + 1]; // BOS
+          on_path[0] = 1;
+        } else // carried from the previous buffer
+          ctx.resize (len + 1, std::make_pair (-1, int64_t (-1))), on_path.resize (len + 1, 0);
+        for (size_t i = 0; i < lim; ++i) {
+          if (ctx[i].first == -1) continue; // unreachable
+          token_t g = {};
+          g.r = _da.longestPatternSearch (p + i, q, ctx[i].first, _c2i);
+          const size_t num = _da.commonPatternSearch (p + i, q, ctx[i].first, _c2i, match);
+          uint32_t count = 0;
+          for (size_t j = 0; j < num; ++j) {
+            edge[j] = std::make_pair (_cnt[match[j].second], match[j].first);
+            if (edge[j].second == g.r && edge[j].first > count) count = edge[j].first;
+          }
+          std::sort (edge, edge + num, std::greater <std::pair <uint32_t, int> > ());
+          const size_t e = _expand_edge (p, len, i, g, on_path[i], count, ctx, on_path);
+          if (! on_path[i])
+            _print_edge (run.n ? hwriter : writer, base + i, base + e, false, count, p + i, false, _p2f[g.id]);
+          else if (run.n && _concat (run.s, g)) { // jagger concatenates g to run
+            ++run.n, run.s = g, run.end = base + e, run.surf.append (p + i, e - i);
+            _print_edge (hwriter, base + i, base + e, false, count, p + i, false, _p2f[g.id]);
+          } else {
+            _close_run (writer, hwriter, held, run, out);
+            const run_t r = { base + i, base + e, base + e, 1, g, g, count, std::string (p + i, e - i) };
+            run = r;
+          }
+          seen.assign (1, g.r);
+          for (size_t j = 0; j < num && seen.size () <= k; ++j)
+            if (std::find (seen.begin (), seen.end (), edge[j].second) == seen.end ()) { // patterns may share a value
+              token_t s = {};
+              s.r = edge[j].second;
+              const size_t e_ = _expand_edge (p, len, i, s, false, edge[j].first, ctx, on_path);
+              _print_edge (run.n ? hwriter : writer, base + i, base + e_, false, edge[j].first, p + i, false, _p2f[s.id]);
+              seen.push_back (s.r);
+            }
+        }
+        if (cont) { // keep states after lim; no EOS
+          ctx.erase (ctx.begin (), ctx.begin () + lim);
+          on_path.erase (on_path.begin (), on_path.begin () + lim);
+          reader.advance (static_cast <int> (lim));
+          base += lim;
+          trim_if_over ();
+          continue;
+        }
+        _close_run (writer, hwriter, held, run, out);
+        writer.write ("EOS\n", 4);
+        reader.advance (static_cast <int> (len + (q != reader.end ())));
+        base = 0;
+        if (TTY) writer.flush (); // line buffering
+        if (reader.eob ()) reader.read (), trim_if_over ();
+      }
+    }
+    // report model statistics to stdout; profile trie accesses and patterns
+    // on a sample corpus read from fd in (if in != -1)
+    void inspect (const int in = -1, const size_t top = 20) const {
+      typedef ccedar::da_::node node;
+      const node* const array_ = _da.array ();
+      size_t size (0), bytes (0), fs_bytes (0);
+      for (size_t i = 0; i < _mmaped.size (); ++i) {
+        bytes += _mmaped[i].second;
+        if (_mmaped[i].first == array_) size = _mmaped[i].second / sizeof (node);
+        if (_mmaped[i].first == _fs) fs_bytes = _mmaped[i].second;
+      }
+      std::vector <int> i2c; // id -> code point (-1 for POS)
+      size_t nchar (0), block[5] = {}; // ASCII, kana, kanji, full-width, others
+      for (size_t cp = 0; cp <= CP_MAX; ++cp)
+        if (const size_t i = _c2i[cp]) {
+          if (i >= i2c.size ()) i2c.resize (i + 1, -1);
+          i2c[i] = static_cast <int> (cp);
+          ++nchar;
+          ++block[cp < 0x80 ? 0 : cp >= 0x3040 && cp < 0x3100 ? 1 : cp >= 0x4e00 && cp < 0xa000 ? 2 : cp >= 0xff00 && cp < 0xfff0 ? 3 : 4];
+        }
+      std::vector <size_t> depth;
+      size_t used (1), npat (0), npos (0);
+      for (size_t i = 1; i < size; ++i) {
+        if (array_[i].check < 0) continue;
+        ++used;
+        const size_t from = static_cast <size_t> (array_[i].check);
+        if (array_[from].base != static_cast <int> (i)) continue; // not terminal
+        ++npat;
+        const bool pos = _label (from) >= i2c.size () || i2c[_label (from)] == -1; // ends with POS
+        size_t d = 0;
+        for (size_t to = from; to; to = static_cast <size_t> (array_[to].check)) ++d;
+        npos += pos, d -= pos;
+        if (d >= depth.size ()) depth.resize (d + 1, 0);
+        ++depth[d];
+      }
+      std::printf ("model bytes:\t%ld\n", static_cast <long> (bytes));
+      std::printf ("model hash:\t%016llx (", static_cast <unsigned long long> (_header.hash[6]));
+      for (size_t i = 0; MODEL_FILES[i]; ++i)
+        std::printf ("%s%s %016llx", i ? ", " : "", MODEL_FILES[i], static_cast <unsigned long long> (_header.hash[i]));
+      std::printf (")\n");
+      std::printf ("trie nodes:\t%ld / %ld (%.1f%% used, %ld bytes)\n", static_cast <long> (used), static_cast <long> (size), 100.0 * used / std::max (size, size_t (1)), static_cast <long> (size * sizeof (node)));
+      std::printf ("patterns:\t%ld (%ld conditioned on previous POS)\n", static_cast <long> (npat), static_cast <long> (npos));
+      std::printf ("features:\t%ld bytes\n", static_cast <long> (fs_bytes));
+      std::printf ("chars (c2i):\t%ld (ASCII %ld, kana %ld, kanji %ld, full-width %ld, others %ld)\n", static_cast <long> (nchar), static_cast <long> (block[0]), static_cast <long> (block[1]), static_cast <long> (block[2]), static_cast <long> (block[3]), static_cast <long> (block[4]));
+      std::printf ("pattern length (chars):");
+      for (size_t d = 0; d < depth.size (); ++d)
+        if (depth[d]) std::printf (" %ld:%ld", static_cast <long> (d), static_cast <long> (depth[d]));
+      std::printf ("\n");
+      if (in == -1) return;
+      // profile; hits and trie steps per node and per pattern (by the node
+      // holding its value; patterns may share the same feature id)
+      std::vector <uint64_t> visit (size, 0), hit (size, 0), step (size, 0);
+      uint64_t nstep (0), npos_ (0);
+      simple_reader reader (in);
+      for (int ti = _c2i[CP_MAX + 1]; ! reader.eob (); ) {
+        const char* const p = reader.ptr (), * const end = reader.end ();
+        int shift = 1;
+        if (*p == '\n') ti = _c2i[CP_MAX + 1]; // BOS
+        else {
+          size_t n (0), slot (0);
+          shift = _search_steps (p, end, ti, n, slot, visit.data ());
+          if (slot) ++hit[slot], step[slot] += n;
+          nstep += n, ++npos_;
+        }
+        reader.advance (shift);
+        if (! reader.readable (lookahead ())) reader.read ();
+      }
+      std::sort (visit.begin (), visit.end (), std::greater <uint64_t> ());
+      uint64_t total = 0;
+      for (size_t i = 0; i < visit.size (); ++i) total += visit[i];
+      size_t touched (0), hot (0);
+      for (uint64_t acc = 0; touched < visit.size () && visit[touched]; ++touched)
+        if (acc * 10 < total * 9) acc += visit[touched], hot = touched + 1;
+      std::printf ("sample:\t%ld searches, %.2f trie steps / search\n", static_cast <long> (npos_), static_cast <double> (nstep) / std::max (npos_, uint64_t (1)));
+      std::printf ("nodes touched:\t%ld; 90%% of steps in %ld nodes (%ld KiB)\n", static_cast <long> (touched), static_cast <long> (hot), static_cast <long> (hot * sizeof (node) >> 10));
+      std::vector <std::pair <uint64_t, size_t> > hot_pat; // <steps, slot>
+      for (size_t i = 0; i < step.size (); ++i)
+        if (hit[i]) hot_pat.push_back (std::make_pair (step[i], i));
+      std::sort (hot_pat.begin (), hot_pat.end (), std::greater <std::pair <uint64_t, size_t> > ());
+      std::printf ("hot patterns:\t%%steps\thits\tpattern\tfeature\n");
+      for (size_t j = 0; j < hot_pat.size () && j < top; ++j) {
+        const size_t slot = hot_pat[j].second;
+        std::string key;
+        for (size_t to = static_cast <size_t> (array_[slot].check); to; to = static_cast <size_t> (array_[to].check)) {
+          const size_t l = _label (to);
+          char buf[16];
+          if (l < i2c.size () && i2c[l] != -1) key.insert (0, buf, _encode (i2c[l], buf));
+          else key.insert (0, buf, std::sprintf (buf, "<%ld>", static_cast <long> (l))); // POS
+        }
+        token_t s = {};
+        s.r = array_[slot].value;
+        const feat_info_t& finfo = _p2f[s.id];
+        std::printf ("%ld\t%.2f\t%ld\t%s", static_cast <long> (j + 1), 100.0 * hot_pat[j].first / nstep, static_cast <long> (hit[slot]), key.c_str ());
+        std::printf ("%.*s", static_cast <int> (finfo.core_feat_len), &_fs[finfo.core_feat_offset]);
+        std::printf ("%.*s", static_cast <int> (finfo.feat_len), &_fs[finfo.feat_offset]);
+      }
+    }
+    // count trie steps to tag [p, end) as inspect () does; return # searches
+    uint64_t count_steps (const char* p, const char* const end, uint64_t& nstep) const {
+      uint64_t nsearch = 0;
+      for (int ti = _c2i[CP_MAX + 1]; p < end; ) {
+        int shift = 1;
+        if (*p == '\n') ti = _c2i[CP_MAX + 1]; // BOS
+        else {
+          size_t n (0), slot (0);
+          shift = _search_steps (p, end, ti, n, slot);
+          nstep += n, ++nsearch;
+        }
+        p += shift;
+      }
+      return nsearch;
+    }
+  private:
+    // a pattern search at p (not EOS) profiled for inspect () / count_steps ();
+    // n: trie steps (incl. the search), slot: node holding the value of the
+    // matched pattern (0 if none), visit: counts of trie nodes walked through
+    int _search_steps (const char* p, const char* const end, int& ti, size_t& n, size_t& slot, uint64_t* visit = 0) const {
+      size_t from (0), pos (0);
+      int i (0), b (0);
+      for (ccedar::da_::u8_feeder f (p, end); (i = _c2i[f.read (b)]); f.advance (b), ++n)
+        if (_da.traverse (&i, from, pos = 0, 1) == ccedar::NO_PATH) break;
+        else if (visit) ++visit[from];
+      token_t s = {};
+      s.r = _da.longestPatternSearch (p, end, ti, _c2i, 0, &slot);
+      ti = _p2f[s.id].ti;
+      ++n;
+      return _shift (p, end, s);
+    }
+    // bytes of input matched by s (shift is set unless matched)
+    int _shift (const char* p, const char* const end, token_t& s) const {
+      if (! s.shift) return s.shift = std::min (static_cast <int> (u8_len (p)), static_cast <int> (end - p)); // truncated at EOF
+      if (s.shift > end - p) return s.shift = static_cast <int> (end - p); // truncated char matched at EOF
+      if (! _fold) return s.shift;
+      int n (0), b (0); // shift counts bytes of folded characters
+      for (int m = 0; m < static_cast <int> (s.shift) && p + n < end; n += b) {
+        const int cp = unicode (p + n, b), to = fold_width (cp);
+        m += to != cp && _c2i[cp] && _c2i[cp] == _c2i[to] ? (to > 0xffff) + (to > 0x7ff) + (to > 0x7f) + 1 : b;
+      }
+      return n;
+    }
+    struct chunk_t { // input [begin, end) tagged from <s_prev, finfo> (BOS)
+      struct rec_t { size_t pos, off; int r; }; // state and output offset at a step
+      size_t begin, end, p; // tagging stops at p (>= end)
+      token_t s_prev;
+      feat_info_t finfo;
+      std::string out;
+      std::vector <rec_t> rec; // of the first steps
+    };
+    template <const bool TAGGING>
+    void _tag_chunk (const char* const p0, const size_t len, chunk_t* c, const bool last, const int out) const { // out: fd or -1
+      static const size_t MAX_REC = 1 << 16; // joins are expected within a few words
+      bind (); // read node-local replicas
+      token_t s_prev = c->s_prev;
+      feat_info_t finfo = c->finfo;
+      size_t p = c->begin;
+      {
+        simple_writer writer (out, out == -1 ? &c->out : 0);
+        for (const size_t end = last ? len : c->end; p < end; ) {
+          if (out == -1 && c->rec.size () < MAX_REC) {
+            const typename chunk_t::rec_t r = { p, writer.size (), s_prev.r };
+            c->rec.push_back (r);
+          }
+          p += step <TAGGING> (p0 + p, p0 + len, s_prev, finfo, writer);
+          if (! writer.writable (max_step_bytes ())) writer.flush (), trim_if_over ();
+        }
+        if (last) finish <TAGGING> (s_prev, finfo, writer);
+      }
+      c->p = p, c->s_prev = s_prev, c->finfo = finfo;
+    }
+    // tag [0, lim) of p0 from (s_prev, finfo) in chunks by nthreads; chunk
+    // outputs are written to out in order as soon as they are joined;
+    // return where tagging stopped (>= lim), with the state there
+    template <const bool TAGGING>
+    size_t _tag_round (const size_t nthreads, const char* const p0, const size_t len, const size_t lim, const bool eof, const size_t min_chunk, token_t& s_prev, feat_info_t& finfo, const int out) const {
+      const size_t k = std::max (size_t (1), std::min (nthreads, lim / std::max (min_chunk, size_t (1)) + 1));
+      std::vector <chunk_t> chunk (k);
+      for (size_t j = 0; j < k; ++j) { // split at character boundaries
+        size_t b = lim * j / k;
+        while (j && b < lim && (p0[b] & 0xc0) == 0x80) ++b; // chunk 0 may start with stray bytes
+        chunk[j].begin = b;
+      }
+      for (size_t j = 0; j < k; ++j)
+        chunk[j].end = j + 1 < k ? chunk[j + 1].begin : lim;
+      chunk[0].s_prev = s_prev, chunk[0].finfo = finfo; // others from BOS
+      for (size_t j = 1; j < k; ++j)
+        chunk[j].s_prev.r = 0, chunk[j].finfo.ti = _c2i[CP_MAX + 1];
+      std::vector <std::thread> pool;
+      for (size_t j = 1; j < k; ++j)
+        pool.push_back (std::thread (&tagger::_tag_chunk <TAGGING>, &worker (j), p0, len, &chunk[j], eof && j + 1 == k, -1));
+      _tag_chunk <TAGGING> (p0, len, &chunk[0], eof && k == 1, out); // from the true state
+      size_t p = chunk[0].p;
+      s_prev = chunk[0].s_prev, finfo = chunk[0].finfo;
+      std::string bridge; // tagged from the true state until joined
+      for (size_t j = 1; j < k; ++j) {
+        pool[j - 1].join (); // stream chunks in order as they finish
+        chunk_t& c = chunk[j];
+        size_t i = 0;
+        bool joined = false;
+        bridge.clear ();
+        {
+          simple_writer writer (bridge);
+          for (; ; p += step <TAGGING> (p0 + p, p0 + len, s_prev, finfo, writer)) {
+            for (; i < c.rec.size () && c.rec[i].pos < p; ++i) ;
+            if (i < c.rec.size () && c.rec[i].pos == p && c.rec[i].r == s_prev.r) { joined = true; break; }
+            if (p >= c.end) break; // the whole chunk is tagged again
+            if (! writer.writable (max_step_bytes ())) writer.flush ();
+          }
+          if (! joined && eof && j + 1 == k) finish <TAGGING> (s_prev, finfo, writer);
+        }
+        _write_all (out, bridge.data (), bridge.size ());
+        if (joined) {
+          _write_all (out, c.out.data () + c.rec[i].off, c.out.size () - c.rec[i].off);
+          p = c.p, s_prev = c.s_prev, finfo = c.finfo;
+        }
+        std::string ().swap (c.out); // release as soon as written
+      }
+      return p;
+    }
+    static void _write_all (const int fd, const char* s, size_t len) {
+      for (long n = 0; len && (n = ::write (fd, s, len)) > 0; s += n, len -= n) ;
+    }
+    template <const bool TAGGING>
+    void _batch_step (const char*& p, const char* const end, const char* const beg, token_t& s_prev, int& ti, std::vector <word_t>& words) const {
+      if (*p == '\n') { // EOS
+        s_prev.r = 0;
+        ti = _c2i[CP_MAX + 1]; // BOS
+        ++p;
+        return;
+      }
+      token_t s = {};
+      s.r = _da.longestPatternSearch (p, end, ti, _c2i);
+      const int shift = std::min (_shift (p, end, s), static_cast <int> (end - p)); // invalid UTF-8
+      if (s_prev.r && (s.concat = _concat (s_prev, s)))
+        words.back ().len += shift;
+      else {
+        const word_t w = { static_cast <uint32_t> (p - beg), static_cast <uint32_t> (shift), 0, 0 };
+        words.push_back (w);
+      }
+      words.back ().id = s.id;
+      words.back ().concat = s.concat;
+      ti = TAGGING ? _p2f[s.id].ti : s.id; // POS id for -w
+      s_prev = s;
+      p += shift;
+    }
+    void _write_fs (simple_writer& writer, const size_t offset, const size_t len) const {
+      if (offset + len <= _fs_wide) writer.write_wide (&_fs[offset], len); else writer.write (&_fs[offset], len);
+    }
+    void _read_header (const std::string& m) { // w/o header, default widths and no hash
+      const model_header_t h = model_header ();
+      model_header_t& g = _header;
+      g = h, g.key_bits = 14, g.pattern_bits = 7, g.feature_bits = 9, g.compact = 0;
+      const int fd = __open ((m + ".hdr").c_str (), O_RDONLY);
+      if (fd != -1) {
+        ERR_IF (::read (fd, &g, sizeof (g)) < static_cast <long> (offsetof (model_header_t, hash)) || std::memcmp (g.magic, h.magic, sizeof (h.magic)), "broken model header: %s.hdr", m.c_str ());
+        _close (fd);
+      }
+      ERR_IF (! g.compact, "%s stores features w/o the core / lex split; retrain it", m.c_str ());
+      ERR_IF (std::memcmp (&g, &h, offsetof (model_header_t, hash)), "%s needs a build with -DJAGGER_KEY_BITS=%u -DJAGGER_PATTERN_BITS=%u -DJAGGER_FEATURE_BITS=%u",
+              m.c_str (), g.key_bits, g.pattern_bits, g.feature_bits);
+    }
+    static bool _concat (const token_t s_prev, const token_t s) { // unknown word continues
+      return s_prev.ctype == s.ctype && // char type mismatch
+             s_prev.ctype != OTHER &&   // kanji, symbol
+             (s_prev.ctype != KANA || s_prev.shift + s.shift < 18);
+    }
+    const std::string& _term (const std::string& surf, const bool concat, const feat_info_t finfo, const int field, std::string& f) const { // f: buffer
+      if (field < 0 || concat) return surf; // features of unknown words are *
+      f.assign (&_fs[finfo.core_feat_offset], finfo.core_feat_len);
+      f.append (&_fs[finfo.feat_offset], finfo.feat_len);
+      size_t i = 1; // skip \t
+      for (int n = 0; n < field && i < f.size (); ++i)
+        if (f[i] == ',') ++n;
+      const size_t j = std::min (f.find_first_of (",\n", i), f.size ());
+      if (i >= f.size () || (j - i == 1 && f[i] == '*')) return surf;
+      f = f.substr (i, j - i);
+      return f;
+    }
+    static bool _crosses (const char* p, const char* q) { // broken char before q runs over q
+      for (int k = 1; k <= 3 && q - k >= p; ++k)
+        if (u8_len (q - k) > k) return true;
+      return false;
+    }
+    size_t _label (const size_t to) const { // label from parent to node
+      const ccedar::da_::node* const array_ = _da.array ();
+      return static_cast <size_t> (array_[array_[to].check].base ^ static_cast <int> (to));
+    }
+    static int _encode (int cp, char* c) { // code point -> UTF-8
+      int b = (cp > 0xffff) + (cp > 0x7ff) + (cp > 0x7f);
+      const int len = b + 1;
+      for (c[0] = "\0\xc0\xe0\xf0"[b] | (cp >> (6 * b)); b; cp >>= 6)
+        c[b--] = static_cast <char> (0x80 | (cp & 0x3f));
+      return len;
+    }
+    struct run_t { // greedy edges [begin, end) jagger outputs as one token
+      size_t begin, end, end0, n; // end0: end of the first edge; n: # edges
+      token_t s0, s; // first and last patterns
+      uint32_t count; // of the first pattern
+      std::string surf;
+    };
+    // edge of s from i; return its end; states after greedy edges are
+    // expanded as jagger does, others by the most frequent incoming edge
+    size_t _expand_edge (const char* p, const size_t len, const size_t i, token_t& s, const bool greedy, const uint32_t count, std::vector <std::pair <int, int64_t> >& ctx, std::vector <char>& on_path) const {
+      const size_t j = i + _shift (p + i, p + len, s);
+      const feat_info_t finfo = _p2f[s.id];
+      if (greedy)
+        on_path[j] = 1, ctx[j] = std::make_pair (static_cast <int> (finfo.ti), INT64_MAX);
+      else if (count > ctx[j].second)
+        ctx[j] = std::make_pair (static_cast <int> (finfo.ti), int64_t (count));
+      return j;
+    }
+    void _print_edge (simple_writer& writer, const size_t from, const size_t to, const bool greedy, const uint32_t count, const char* surf, const bool concat, const feat_info_t finfo) const {
+      if (! writer.writable (max_step_bytes () + 64)) writer.flush (); // + edge numbers
+      char buf[64];
+      writer.write (buf, std::sprintf (buf, "%ld\t%ld\t%d\t%u\t", static_cast <long> (from), static_cast <long> (to), greedy, count));
+      for (size_t k (0), n (0); k < to - from; k += n) { // joined surface may exceed the buffer
+        n = std::min (to - from - k, BUF_SIZE / 2);
+        if (! writer.writable (n)) writer.flush ();
+        writer.write (surf + k, n);
+      }
+      if (! writer.writable (max_step_bytes ())) writer.flush ();
+      write_feature (writer, concat, finfo);
+    }
+    // print the greedy edge of run (joined if jagger concatenates patterns),
+    // then edges held since its start
+    void _close_run (simple_writer& writer, simple_writer& hwriter, std::string& held, run_t& run, const int out) const {
+      if (! run.n) return;
+      _print_edge (writer, run.begin, run.end, true, run.count, run.surf.data (), run.n > 1, _p2f[run.s.id]);
+      if (run.n > 1) // the first pattern
+        _print_edge (writer, run.begin, run.end0, false, run.count, run.surf.data (), false, _p2f[run.s0.id]);
+      hwriter.flush ();
+      writer.flush ();
+      _write_all (out, held.data (), held.size ());
+      held.clear ();
+      run.n = 0;
+    }
+  };
+  // push-based tagging of input fragments; output does not depend on how
+  // input is split, while the last tagger::lookahead () bytes are held until
+  // more input or finish (); with cache, a line is held until its end comes
+  // (up to sentence_cache::max_len () bytes) to be tagged as a whole
+  template <const bool TAGGING>
+  class stream_tagger {
+  private:
+    const tagger& _tagger;
+    simple_writer& _writer;
+    sentence_cache* _cache;
+    std::vector <char> _buf; // pending input + zero-filled slack
+    size_t _p, _q;
+    bool _bol;
+    token_t _s_prev;
+    feat_info_t _finfo;
+    void _tag (const size_t min) {
+      while (_p < _q) {
+        if (_cache && _bol) { // whole line
+          const size_t n = std::min (_q - _p, _cache->max_len ());
+          if (const char* q = static_cast <const char*> (std::memchr (&_buf[_p], '\n', n))) {
+            if (const size_t len = _tagger.tag_line <TAGGING> (*_cache, &_buf[_p], q, &_buf[_q], _s_prev, _finfo, _writer)) {
+              _p += len;
+              if (! _writer.writable (_tagger.max_step_bytes ())) _writer.flush ();
+              continue;
+            }
+          } else if (n < _cache->max_len () && min > 1) break; // wait for the line end
+        }
+        if (_q - _p < min) break;
+        _bol = _buf[_p] == '\n';
+        _p += _tagger.step <TAGGING> (&_buf[_p], &_buf[_q], _s_prev, _finfo, _writer);
+        if (! _writer.writable (_tagger.max_step_bytes ())) _writer.flush ();
+      }
+    }
+  public:
+    stream_tagger (const tagger& t, simple_writer& writer, sentence_cache* cache = 0) : _tagger (t), _writer (writer), _cache (cache), _buf (WIDE_SIZE, 0), _p (0), _q (0), _bol (true), _s_prev (), _finfo () { _tagger.finish <TAGGING> (_s_prev, _finfo, _writer); }
+    void feed (const char* p, const size_t len) {
+      if (_p) { // drop tagged input
+        std::memmove (&_buf[0], &_buf[_p], _q - _p);
+        _q -= _p;
+        _p = 0;
+      }
+      _buf.resize (_q + len + WIDE_SIZE);
+      std::memcpy (&_buf[_q], p, len);
+      _q += len;
+      std::fill (_buf.begin () + _q, _buf.end (), 0);
+      _tag (_tagger.lookahead ());
+      _tagger.trim_if_over ();
+    }
+    void finish () { // tag the rest; the stream can be reused
+      _tag (1);
+      _p = _q = 0;
+      _bol = true;
+      _tagger.finish <TAGGING> (_s_prev, _finfo, _writer);
+    }
+  };
+  // resumable tagging of a whole buffer in bounded slices (for event loops);
+  // with cache, output of lines is looked up in / stored to it
+  template <const bool TAGGING>
+  class tag_job {
+  private:
+    const tagger& _tagger;
+    sentence_cache* _cache;
+    std::vector <char> _buf; // input + zero-filled slack
+    size_t _p, _end;
+    bool _bol, _done;
+    token_t _s_prev;
+    feat_info_t _finfo;
+    std::string _out;
+    simple_writer _writer;
+  public:
+    tag_job (const tagger& t, const char* p, const size_t len, sentence_cache* cache = 0) : _tagger (t), _cache (cache), _buf (p, p + len), _p (0), _end (len), _bol (true), _done (false), _s_prev (), _finfo (), _out (), _writer (_out) {
+      _buf.resize (len + WIDE_SIZE, 0);
+      _tagger.finish <TAGGING> (_s_prev, _finfo, _writer);
+    }
+    // tag up to max_bytes of input or for max_usec (if non-zero); true if done
+    bool resume (const size_t max_bytes = BUF_SIZE, const long max_usec = 0) {
+      const size_t stop = _p + std::min (_end - _p, std::max (max_bytes, size_t (1)));
+      const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now () + std::chrono::microseconds (max_usec);
+      for (size_t n = 1; _p < stop; ++n) {
+        const char* const q = _cache && _bol ? static_cast <const char*> (std::memchr (&_buf[_p], '\n', std::min (_end - _p, _cache->max_len ()))) : 0;
+        if (const size_t len = q ? _tagger.tag_line <TAGGING> (*_cache, &_buf[_p], q, &_buf[_end], _s_prev, _finfo, _writer) : 0)
+          _p += len; // whole line
+        else {
+          _bol = _buf[_p] == '\n';
+          _p += _tagger.step <TAGGING> (&_buf[_p], &_buf[_end], _s_prev, _finfo, _writer);
+        }
+        if (! _writer.writable (_tagger.max_step_bytes ())) _writer.flush ();
+        if (max_usec && n % 256 == 0 && std::chrono::steady_clock::now () >= deadline) break;
       }
+      if (_p == _end && ! _done)
+        _tagger.finish <TAGGING> (_s_prev, _finfo, _writer), _done = true;
+      _writer.flush ();
+      _tagger.trim_if_over ();
+      return _done;
     }
+    bool done () const { return _done; }
+    size_t consumed () const { return _p; }
+    std::string& output () { return _out; } // may be drained between resumes
   };
 }
 #endif
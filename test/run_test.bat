@@ -0,0 +1,38 @@
+@echo off
+rem regression test: train a model on the fixture corpus / dictionary and
+rem compare outputs of each mode with the checked-in expected outputs
+rem  usage: test\run_test.bat [Jagger.exe [Train_Jagger.exe]]
+setlocal
+set dir=%~dp0
+set jagger=%~1
+set train=%~2
+if "%jagger%"=="" set jagger=Jagger.exe
+if "%train%"=="" set train=Train_Jagger.exe
+set tmp_=%TEMP%\jagger_test_%RANDOM%
+mkdir "%tmp_%" || exit /b 1
+"%train%" -m "%tmp_%" -d "%dir%dict.csv" "%dir%train.txt" 2> "%tmp_%\train.log" || (type "%tmp_%\train.log" & goto fail)
+set failed=0
+call :check tag
+call :check seg -w
+call :check lattice -n 2
+call :check fold -f
+call :check_binary postings -b
+"%jagger%" -m "%tmp_%" -s 1 < "%dir%input.txt" > nul 2> "%tmp_%\check.log" && (echo ok      self-check) || (type "%tmp_%\check.log" & set failed=1)
+"%jagger%" -m "%tmp_%" -f -s 1 < "%dir%input.txt" > nul 2> "%tmp_%\check.log" && (echo ok      self-check -f) || (type "%tmp_%\check.log" & set failed=1)
+rmdir /s /q "%tmp_%"
+exit /b %failed%
+:check
+set name=%1
+shift
+"%jagger%" -m "%tmp_%" %1 %2 < "%dir%input.txt" > "%tmp_%\%name%" 2> nul
+rem compare as text; outputs end lines with CRLF on the console
+fc "%dir%expected.%name%" "%tmp_%\%name%" > nul && (echo ok      %name%) || (echo FAILED  %name% & set failed=1)
+exit /b 0
+:check_binary
+set name=%1
+"%jagger%" -m "%tmp_%" %2 < "%dir%input.txt" > "%tmp_%\%name%" 2> nul
+fc /b "%dir%expected.%name%" "%tmp_%\%name%" > nul && (echo ok      %name%) || (echo FAILED  %name% & set failed=1)
+exit /b 0
+:fail
+rmdir /s /q "%tmp_%"
+exit /b 1
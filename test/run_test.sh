@@ -0,0 +1,29 @@
+#!/bin/sh
+# regression test: train a model on the fixture corpus / dictionary and
+# compare outputs of each mode with the checked-in expected outputs
+#  usage: test/run_test.sh [jagger [train_jagger]]
+# set UPDATE=1 to regenerate expected outputs after an intended change
+dir=$(cd "$(dirname "$0")" && pwd)
+jagger=${1:-./jagger}
+train=${2:-./train_jagger}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+"$train" -m "$tmp" -d "$dir/dict.csv" "$dir/train.txt" 2> "$tmp/train.log" || { cat "$tmp/train.log"; exit 1; }
+failed=0
+check () { # name, options
+  name=$1; shift
+  "$jagger" -m "$tmp" "$@" < "$dir/input.txt" > "$tmp/$name" 2> /dev/null
+  if [ -n "$UPDATE" ]; then cp "$tmp/$name" "$dir/expected.$name"
+  elif cmp -s "$tmp/$name" "$dir/expected.$name"; then echo "ok      $name"
+  else echo "FAILED  $name"; diff "$dir/expected.$name" "$tmp/$name" | head -10; failed=1
+  fi
+}
+check tag
+check seg -w
+check lattice -n 2
+check fold -f
+check postings -b
+for opt in "" -f; do # paths must agree wherever input is split
+  "$jagger" -m "$tmp" $opt -s 1 < "$dir/input.txt" > /dev/null 2> "$tmp/check.log" && echo "ok      self-check $opt" || { cat "$tmp/check.log"; failed=1; }
+done
+exit $failed
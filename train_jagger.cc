@@ -2,6 +2,7 @@
 //  $Id: train_jagger.cc 2070 2024-03-14 07:54:57Z ynaga $
 // Copyright (c) 2022 Naoki Yoshinaga <ynaga@iis.u-tokyo.ac.jp>
 #include <jagger.h>
+#include <thread>
 
 #ifdef _WIN32
 #include "getopt.h"
@@ -12,6 +13,17 @@
 #define _fopen std::fopen 
 #endif
 
+#if defined (__SSE2__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline int _ctz (unsigned long x) { unsigned long i; _BitScanForward (&i, x); return static_cast <int> (i); }
+#else
+#define _ctz __builtin_ctz
+#endif
+#endif
+
 #ifdef _WIN32
 FILE* _fopen(const char* filename, const char* mode)
 {
@@ -34,11 +46,111 @@ namespace jagger {
   static const char* FEAT_SYMBOL = "\x09\xE7\x89\xB9\xE6\xAE\x8A\x2C\xE8\xA8\x98\xE5\x8F\xB7\x2C\x2A\x2C\x2A";
   static int UC_SYMBOL_RANGE[][2] = { {0x0021, 0x002F}, {0x003A, 0x0040}, {0x005B, 0x0060}, {0x007B, 0x007E}, {0x00A1, 0x00BF}, {0x00D7, 0x00D7}, {0x00F7, 0x00F7}, {0x2000, 0x206F}, {0x20A0, 0x214F}, {0x2190, 0x2BFF}, {0x3000, 0x3004}, {0x3008, 0x303F}, {0x3200, 0x33FF}, {0xFE30, 0xFE4F}, {0xFE50, 0xFE6B}, {0xFF01, 0xFF0F}, {0xFF1A, 0xFF20}, {0xFF3B, 0xFF40}, {0xFF5B, 0xFF65}, {0xFFE0, 0xFFEF}, {0x10190, 0x1019C}, {0x1F000, 0x1FBFF}, {} }; // Symbol-like Unicode Blocks
   static const char* chars_[] = {"0123456789０１２３４５６７８９〇一二三四五六七八九十百千万億兆数・", "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZａｂｃｄｅｆｇｈｉｊｋｌｍｎｏｐｑｒｓｔｕｖｗｘｙｚＡＢＣＤＥＦＧＨＩＪＫＬＭＮＯＰＱＲＳＴＵＶＷＸＹＺ", "ァアィイゥウェエォオカガキギクグケゲコゴサザシジスズセゼソゾタダチヂッツヅテデトドナニヌネノハバパヒビピフブプヘベペホボポマミムメモャヤュユョヨラリルレロヮワヰヱヲンヴヵヶヷヸヹヺーヽヾヿ", 0}; // characters for concatenation
+  class char_type { // two-level table: code point -> numeric / alpha / kana
+  private:
+    std::vector <uint8_t> _page; // code point >> 8 -> block
+    std::vector <uint8_t> _type; // block << 8 | (code point & 0xff) -> ctype
+  public:
+    char_type () : _page ((CP_MAX >> 8) + 1, 0), _type (256, OTHER) {}
+    void set (const int cp, const int t) {
+      uint8_t& b = _page[cp >> 8];
+      if (! b) b = static_cast <uint8_t> (_type.size () >> 8), _type.resize (_type.size () + 256, OTHER);
+      _type[(b << 8) | (cp & 0xff)] = static_cast <uint8_t> (t);
+    }
+    int operator () (const int cp) const { return _type[(_page[cp >> 8] << 8) | (cp & 0xff)]; }
+    const char* skip (const char* p, const char* const end, const int t) const { // skip run of type t
+#ifdef USE_SSE2
+      if (t == NUM || t == ALPHA) { // 16 ASCII digits / letters at once
+        const __m128i lo (_mm_set1_epi8 (t == NUM ? '0' - 1 : 'a' - 1)), hi (_mm_set1_epi8 (t == NUM ? '9' + 1 : 'z' + 1)), fold (_mm_set1_epi8 (t == NUM ? 0 : 0x20));
+        for (; end - p >= 16; p += 16) {
+          const __m128i v = _mm_or_si128 (_mm_loadu_si128 (reinterpret_cast <const __m128i*> (p)), fold);
+          const int m = ~_mm_movemask_epi8 (_mm_and_si128 (_mm_cmpgt_epi8 (v, lo), _mm_cmplt_epi8 (v, hi))) & 0xffff;
+          if (m) { p += _ctz (m); break; } // may continue with non-ASCII
+        }
+      }
+#endif
+      for (int b = 0; p < end && (*this) (unicode (p, b)) == t; p += b) ;
+      return p;
+    }
+  };
+  typedef std::pair <const char*, const char*> range_t; // [begin, end) of text
+  typedef std::pair <size_t, size_t> sent_range_t;      // [begin, end) of sentence ids
+  class corpus_t { // training data parsed once into tokens and indexed by sentences
+  private:
+    const mapped_file _file;
+    std::vector <const char*> _sent; // sentence i in [_sent[i], _sent[i + 1])
+    std::string _chars;              // characters of sentences
+    std::vector <size_t> _chr, _tok; // sentence i: _chars from _chr[i], tokens in [_tok[i], _tok[i + 1])
+    std::vector <std::pair <uint32_t, uint32_t> > _token; // <len(w), feature id>
+    bag_t <std::string> _feat;       // features starting with '\t'
+    size_t _complete;                // # sentences ending with EOS
+  public:
+    explicit corpus_t (const std::string& fn) : _file (fn), _sent (1, _file.begin ()), _chars (), _chr (1, 0), _tok (1, 0), _token (), _feat (), _complete (0) {
+      line_scanner ls (_file.begin (), _file.end ());
+      for (const char *line (0), *eol (0); ls.next (line, eol); )
+        if (eol - line >= 4 && std::memcmp (line, "EOS\n", 4) == 0) {
+          _sent.push_back (eol);
+          _chr.push_back (_chars.size ()), _tok.push_back (_token.size ());
+        } else { // token
+          const void* q = std::memchr (line, '\t', eol - line);
+          const char* f = q ? static_cast <const char*> (q) : eol;
+          _chars.append (line, f);
+          _token.push_back (std::make_pair (static_cast <uint32_t> (f - line), static_cast <uint32_t> (_feat.to_i (f, eol - f))));
+        }
+      _complete = size ();
+      if (_sent.back () != _file.end ()) { // w/o the last EOS; held out but not mined
+        _sent.push_back (_file.end ());
+        _chr.push_back (_chars.size ()), _tok.push_back (_token.size ());
+      }
+    }
+    size_t size () const { return _sent.size () - 1; }
+    bool complete (const size_t i) const { return i < _complete; }
+    size_t features () const { return _feat.size (); }
+    const std::string& feature (const size_t fi) const { return _feat.to_s (fi); }
+    // characters and tokens of sentence i
+    void sentence (const size_t i, std::string& cs, const std::pair <uint32_t, uint32_t>*& begin, const std::pair <uint32_t, uint32_t>*& end) const {
+      cs.assign (_chars, _chr[i], _chr[i + 1] - _chr[i]);
+      begin = _token.data () + _tok[i], end = _token.data () + _tok[i + 1];
+    }
+    // split sentences into k contiguous folds; return (text of) fold i and
+    // set the rest to train (all if i >= k)
+    range_t fold (const size_t i, const size_t k, std::vector <sent_range_t>& train) const {
+      train.clear ();
+      if (i >= k) {
+        train.push_back (sent_range_t (0, size ()));
+        return range_t (_file.end (), _file.end ());
+      }
+      const size_t b (i * size () / k), e ((i + 1) * size () / k);
+      if (b) train.push_back (sent_range_t (0, b));
+      if (e < size ()) train.push_back (sent_range_t (e, size ()));
+      return range_t (_sent[b], _sent[e]);
+    }
+  };
+  struct dict_entry_t { // seed pattern read from dictionary
+    std::string surf, fs; // fs: features starting with '\t'
+    size_t core;          // length of POS fields in fs
+  };
   class pattern_builder { // build patterns from training data and dictinary
   private:
     bag_t <std::string> _tbag, _fbag;
     std::vector <pat_info_t> _pi2sf; // pi -> <surf, prev_pos, shift, fi, count>
     std::vector <std::pair <size_t, int> > _ccnt;
+    std::vector <bool> _seed; // pi -> kept regardless of count
+    const size_t _nthreads;
+    template <typename Iter, typename Comp>
+    static void _parallel_sort (Iter first, Iter last, Comp comp, const size_t nthreads) { // sort halves in threads and merge
+      if (nthreads <= 1 || last - first < (1 << 16)) return std::sort (first, last, comp);
+      const Iter mid = first + (last - first) / 2;
+      std::thread t (&_parallel_sort <Iter, Comp>, first, mid, comp, nthreads / 2);
+      _parallel_sort (mid, last, comp, nthreads - nthreads / 2);
+      t.join ();
+      std::inplace_merge (first, mid, last, comp);
+    }
+    struct key_less { // order indices of keys
+      const std::vector <std::vector <int> >& keys;
+      key_less (const std::vector <std::vector <int> >& keys_) : keys (keys_) {}
+      bool operator() (const size_t a, const size_t b) const { return keys[a] < keys[b] || (keys[a] == keys[b] && a < b); }
+    };
     template <typename T>
     static inline void _write_array (const T* const data, const size_t size, const std::string& fn) {
       FILE *fp = _fopen(fn.c_str (), "wb");
@@ -46,48 +158,99 @@ namespace jagger {
       std::fwrite (data, sizeof (T), size, fp);
       std::fclose (fp);
     }
+    // rough heap bytes of containers; a node of std::map costs ~32 bytes + pair
+    template <typename K, typename V>
+    static size_t _bytes (const std::map <K, V>& m) { return m.size () * (32 + sizeof (std::pair <const K, V>)); }
+    template <typename K, typename V>
+    static size_t _bytes (const std::vector <std::map <K, V> >& v) {
+      size_t n = v.capacity () * sizeof (std::map <K, V>);
+      for (size_t i = 0; i < v.size (); ++i) n += _bytes (v[i]);
+      return n;
+    }
+    template <typename T>
+    static size_t _bytes (const bag_t <T>& b) { return b.size () * (32 + sizeof (std::pair <const T, int>) + sizeof (T*)); }
+    template <typename T>
+    static size_t _bytes (const std::vector <T>& v) { return v.capacity () * sizeof (T); }
+    template <typename K>
+    static void _incr (std::map <K, int>& m, const K& k, size_t& n) { if (! m[k]++) ++n; } // n: # keys
+    static void _report_memory (const char* phase, const char* names[], const size_t bytes[]) {
+      std::fprintf (stderr, "memory (%s):", phase);
+      for (size_t i = 0; names[i]; ++i)
+        std::fprintf (stderr, " %s %.1fMB", names[i], bytes[i] / 1048576.0);
+      std::fprintf (stderr, "; resident %.1fMB\n", resident_bytes () / 1048576.0);
+    }
+    static int _bits (const size_t n) { int b = 0; while (n >> b) ++b; return b; } // to hold n
     static const char* _strchr_n (const char* p, int c, int n) // find nth c
     { do if (n-- && (p = std::strchr (p, c))) ++p; else return --p; while (1); }
+    static const char* _memchr_n (const char* p, const char* end, int c, int n) { // find nth c in [p, end)
+      for (const void* q = 0; p < end; ++p)
+        if (! (q = std::memchr (p, c, end - p))) break;
+        else if (p = static_cast <const char*> (q), --n == 0) return p;
+      return end;
+    }
+    // rough size of a pattern in .da (half-filled) / .p2f / .fs (if new feature)
+    size_t _pattern_bytes (const pat_info_t& p, std::vector <bool>& fused, const bool use = true) const {
+      size_t len = (p.ti_prev != -1) + 1;
+      for (size_t i = 0; i < p.surf.size (); i += u8_len (&p.surf[i])) ++len;
+      size_t bytes = 2 * len * sizeof (ccedar::da_::node) + sizeof (feat_info_t);
+      if (! fused[p.fi]) bytes += _fbag.to_s (p.fi).size ();
+      if (use) fused[p.fi] = true;
+      return bytes;
+    }
     // examine UTF8 sequence p consist of only numeric / alpha / kana characters
-    static int check_ctype (const char* p, const int len, const char* char_t, int n = ANY) {
-      for (int b (0), offset (0); n && offset < len; offset += b)
-        n &= char_t[unicode (p + offset, b)];
+    static int check_ctype (const char* p, const int len, const char_type& char_t, int n = ANY) {
+      for (const char* const end = p + len; n && p < end; ) {
+        int b = 0;
+        const int t = char_t (unicode (p, b));
+        n &= t;
+        p = char_t.skip (p + b, end, t);
+      }
       return n;
     }
   public:
-    pattern_builder () : _tbag (), _fbag (), _pi2sf (), _ccnt () {}
+    pattern_builder (const size_t nthreads = 1) : _tbag (), _fbag (), _pi2sf (), _ccnt (), _seed (), _nthreads (nthreads) {}
     ~pattern_builder () {}
-    void extract_patterns (const std::string& train, const std::vector <std::string>& dict) {
+    // parse dictionaries once (shared by models on folds)
+    static void read_dict (const std::vector <std::string>& fns, std::vector <dict_entry_t>& dict) {
+      const long max_plen = 1 << MAX_PATTERN_BITS;
+      for (std::vector <std::string>::const_iterator it = fns.begin (); it != fns.end (); ++it) {
+        const mapped_file file (*it);
+        line_scanner ls (file.begin (), file.end ());
+        for (const char *line (0), *eol (0); ls.next (line, eol); ) {
+          const char *p (line), *surf (*p == '"' ? ++p : p);
+          const bool quoted = p != line;
+          p = _memchr_n (p, eol, quoted ? '"' : ',' , 1) + quoted;
+          ERR_IF (p - surf - quoted > max_plen, "rebuild with larger -DJAGGER_PATTERN_BITS not to skip %s", std::string (line, p - line).c_str ());
+          const char *f = _memchr_n (p + 1, eol, ',', 3);
+          if (f >= eol) continue; // malformed (e.g., empty line)
+          dict_entry_t e;
+          e.surf.assign (surf, p - surf - quoted);
+          e.fs.assign (f, eol); // POS starts with '\t'
+          e.fs[0] = '\t';
+          e.core = _memchr_n (f + 1, eol, ',', NUM_POS_FIELD) - f;
+          dict.push_back (e);
+        }
+      }
+    }
+    // stop adding pattern candidates once they use approx. max_mem bytes
+    void extract_patterns (const corpus_t& corpus, const std::vector <sent_range_t>& train, const std::vector <dict_entry_t>& dict, const size_t max_mem = 0) {
       bag_t <std::pair <std::string, int> >  pbag; // pattern -> pi
       std::vector <std::map <std::pair <int, int>, int> > pi2sfic; // pi -> <shift, feature> -> count
       std::vector <std::map <int, int> > si2ti2fi; // unseen seed -> features
       std::vector <int> ti2c (1, -1); // counter to set features (core) for unk
-      char char_t[CP_MAX + 1] = {0};
+      char_type char_t;
       const long max_plen = 1 << MAX_PATTERN_BITS;
       _tbag.to_i ("\tBOS");
       _tbag.to_i (FEAT_UNK);    // t1
       _tbag.to_i (FEAT_NUM);    // t2
       _tbag.to_i (FEAT_SYMBOL); // t3
-      if (! dict.empty ()) { // read seeds from dictionary
-        std::fprintf (stderr, "reading seed patterns from dictionary...");
-        for (std::vector <std::string>::const_iterator it = dict.begin (); it != dict.end (); ++it) {
-          FILE* fp = _fopen (it->c_str (), "r");
-          ERR_IF (! fp, "cannot read from %s\n", it->c_str ());
-          for (char line[BUF_SIZE]; std::fgets (line, BUF_SIZE, fp); ) {
-            const size_t len = std::strlen (line);
-            const char *p (line), *surf (*p == '"' ? ++p : p);
-            const bool quoted = p != line;
-            p = _strchr_n (p, quoted ? '"' : ',' , 1) + quoted;
-            ERR_IF (p - surf - quoted > max_plen, "increase MAX_PATTERN_BITS not to skip %s", std::string (line, p - line).c_str ());
-            const int pi = pbag.to_i (std::make_pair (std::string (surf, p - surf - quoted), -1));
-            char *f = const_cast <char*> (_strchr_n (++p, ',', 3));
-            *f = '\t'; // POS starts with '\t'
-            p = _strchr_n (f, ',', NUM_POS_FIELD);
-            const int ti (_tbag.to_i (f, p - f)), fi (_fbag.to_i (f, line + len - f));
-            si2ti2fi.resize (pbag.size ());
-            si2ti2fi[pi].insert (std::make_pair (ti, fi)); // may not unique
-          }
-          std::fclose (fp);
+      if (! dict.empty ()) { // seeds from dictionary
+        std::fprintf (stderr, "registering seed patterns from dictionary...");
+        for (std::vector <dict_entry_t>::const_iterator it = dict.begin (); it != dict.end (); ++it) {
+          const int pi = pbag.to_i (std::make_pair (it->surf, -1));
+          const int ti (_tbag.to_i (it->fs.substr (0, it->core))), fi (_fbag.to_i (it->fs));
+          si2ti2fi.resize (pbag.size ());
+          si2ti2fi[pi].insert (std::make_pair (ti, fi)); // may not unique
         }
         std::fprintf (stderr, "done; %ld words, %ld features\n", si2ti2fi.size (), _fbag.size ());
       }
@@ -95,7 +258,7 @@ namespace jagger {
       std::fprintf (stderr, "registering concatenating chars and symbols as seed patterns...");
       for (int i (0), b (0); chars_[i]; ++i) // seed from numeric / alpha / kana
         for (const char *p = &chars_[i][0]; *p; pbag.to_i (std::make_pair (std::string (p, b), -1)), p += b)
-          char_t[unicode (p, b)] = 1 << i;
+          char_t.set (unicode (p, b), 1 << i);
       for (int i = 0; UC_SYMBOL_RANGE[i][0]; ++i)
         for (int j = UC_SYMBOL_RANGE[i][0]; j <= UC_SYMBOL_RANGE[i][1]; ++j) {
           int k (j), b ((j > 0xffff) + (j > 0x7ff) + (j > 0x7f));
@@ -104,55 +267,75 @@ namespace jagger {
             c[b--] = 0x80 | (k & 0x3f);
           pbag.to_i (std::make_pair (&c[0], -1));
         }
+      const int num_fixed = static_cast <int> (pbag.size ()); // dictionary words + chars + symbols
       std::fprintf (stderr, "done.\n");
       ti2c.resize (_tbag.size (), 0);
       pi2sfic.resize (pbag.size ());
       std::fprintf (stderr, "mining patterns from training data...");
       { // notations follow https://aclanthology.org/2023.acl-short.2/
         std::string cs; // sequence of characters
-        std::vector <std::pair <size_t, std::string> > ss; // tokens <len(w), t>
-        FILE* fp = _fopen (train.c_str (), "r");
-        ERR_IF (! fp, "cannot read from %s\n", train.c_str ());
-        for (char line[BUF_SIZE]; std::fgets (line, BUF_SIZE, fp); ) {
-          const size_t len = std::strlen (line);
-          if (std::strncmp (line, "EOS\n", 4) == 0) {
-            for (size_t i (0), j (0), ti (0), ti_prev (0); j < ss.size (); i += ss[j].first, ti_prev = ti, ++j) {
-              const long shift (ss[j].first), fi (_fbag.to_i (ss[j].second));
-              ERR_IF (shift >> MAX_PATTERN_BITS, "increase MAX_PATTERN_BITS not to skip %s", cs.substr (i, shift).c_str ()); // for empty dict
+        const std::pair <uint32_t, uint32_t> *ss (0), *ss_end (0); // tokens <len(w), t>
+        std::vector <int> f2fi (corpus.features (), -1), f2ti (corpus.features (), -1); // corpus -> model ids
+        bool frozen = false; // count known candidates only (-M)
+        long nsent = 0;
+        size_t nsfic = 0; // # <shift, feature> counted in pi2sfic
+        const size_t fixed_bytes = _bytes (si2ti2fi), sfic_bytes = 32 + sizeof (std::map <std::pair <int, int>, int>::value_type);
+        for (size_t r = 0; r < train.size (); ++r)
+          for (size_t sid = train[r].first; sid < train[r].second && corpus.complete (sid); ++sid) {
+            corpus.sentence (sid, cs, ss, ss_end);
+            ++nsent;
+            if (max_mem && ! frozen) { // same estimate as _bytes (pbag) + _bytes (pi2sfic) + ...
+              const size_t bytes = _bytes (pbag) + pi2sfic.capacity () * sizeof (pi2sfic[0]) + nsfic * sfic_bytes + fixed_bytes + _bytes (_fbag);
+              if (bytes > max_mem) {
+                std::fprintf (stderr, "\nwarning: candidates use %ld bytes at sentence %ld; stop adding pattern candidates...", static_cast <long> (bytes), nsent);
+                frozen = true;
+              }
+            }
+            for (size_t i (0), j (0), ti (0), ti_prev (0); j < static_cast <size_t> (ss_end - ss); i += ss[j].first, ti_prev = ti, ++j) {
+              int& fi_ = f2fi[ss[j].second];
+              if (fi_ == -1) fi_ = static_cast <int> (_fbag.to_i (corpus.feature (ss[j].second)));
+              const long shift (ss[j].first), fi (fi_);
+              ERR_IF (shift >> MAX_PATTERN_BITS, "rebuild with larger -DJAGGER_PATTERN_BITS not to skip %s", cs.substr (i, shift).c_str ()); // for empty dict
               for (int k = shift; i + k <= cs.size () && k <= max_plen; k += u8_len (&cs[i + k])) {
                 const int pi_max = pbag.size ();
+                if (frozen && (pbag.find (std::make_pair (cs.substr (i, k), -1)) == pbag.end () ||
+                               pbag.find (std::make_pair (cs.substr (i, k), ti_prev)) == pbag.end ())) break;
                 const int pi  = pbag.to_i (std::make_pair (cs.substr (i, k), -1));
                 const int pi_ = pbag.to_i (std::make_pair (cs.substr (i, k), ti_prev));
                 pi2sfic.resize (pbag.size ());
-                ++pi2sfic[pi][std::make_pair (shift, fi)];
-                ++pi2sfic[pi_][std::make_pair (shift, fi)];
+                _incr (pi2sfic[pi], std::pair <int, int> (shift, fi), nsfic);
+                _incr (pi2sfic[pi_], std::pair <int, int> (shift, fi), nsfic);
                 if (pi >= pi_max) break; // skip pattern extension; heuristics
               }
-              const char* fs = ss[j].second.c_str ();
-              const int n = pbag.to_i (std::make_pair (cs.substr (i, shift), -1));
-              ti = _tbag.to_i (fs, _strchr_n (fs, ',', NUM_POS_FIELD) - fs);
+              const bag_t <std::pair <std::string, int> >::iter it = pbag.find (std::make_pair (cs.substr (i, shift), -1));
+              const int n = it == pbag.end () ? static_cast <int> (pbag.size ()) : it->second; // unseen if frozen
+              int& ti_ = f2ti[ss[j].second];
+              if (ti_ == -1) {
+                const char* fs = corpus.feature (ss[j].second).c_str ();
+                ti_ = static_cast <int> (_tbag.to_i (fs, _strchr_n (fs, ',', NUM_POS_FIELD) - fs));
+              }
+              ti = ti_;
               if (n >= num_seed && check_ctype (&cs[i], shift, char_t) != NUM) { // for unseen tokens
                 ti2c.resize (_tbag.size (), 0); // fi -> _fbag.size (); bug fix
                 ++ti2c[ti];
                 const int pi = pbag.to_i (std::make_pair ("", ti_prev));
                 const int fi_unk = _fbag.to_i (_tbag.to_s (ti) + ",*,*,*\n");
                 pi2sfic.resize (pbag.size ());
-                ++pi2sfic[pi][std::make_pair (0, fi_unk)];
+                _incr (pi2sfic[pi], std::make_pair (0, fi_unk), nsfic);
               }
             }
-            cs.clear ();
-            ss.clear ();
-          } else { // token
-            const char * const p (line), *f (_strchr_n (p, '\t', 1));
-            cs += std::string (p, f - p);
-            ss.push_back (std::make_pair (f - p, std::string (f, p + len - f)));
           }
-        }
-        std::fclose (fp);
       }
       std::fprintf (stderr, "done; %ld pattern candidates\n", pbag.size ());
+      {
+        const char* names[] = { "pbag", "pi2sfic", "si2ti2fi", "fbag", 0 };
+        const size_t bytes[] = { _bytes (pbag), _bytes (pi2sfic), _bytes (si2ti2fi), _bytes (_fbag) };
+        _report_memory ("mined", names, bytes);
+      }
+      size_t trie_bytes = 0;
       { // pruning patterns
         ccedar::da <char, int> patterns;
+        _ccnt.reserve (CP_MAX + 1 + _tbag.size ());
         for (size_t i = 0; i < CP_MAX + 1 + _tbag.size (); ++i)
           _ccnt.push_back (std::make_pair (0, _ccnt.size ()));
         std::fprintf (stderr, "pruning patterns...");
@@ -206,33 +389,69 @@ namespace jagger {
           else // record surface-only patterns for pruning
             patterns.update (c.c_str (), c.size ()) = static_cast <int> (_pi2sf.size ());
           _pi2sf.push_back (pat_info_t (c, p.second, count, shift, ctype, fi));
+          _seed.push_back (pi < num_fixed || c.empty ()); // seeds or unknown words
         }
+        trie_bytes = patterns.size () * (sizeof (ccedar::da <char, int>::node) + 2);
       }
       std::fprintf (stderr, "done; %ld -> %ld patterns\n", pi2sfic.size (), _pi2sf.size ());
+      const char* names[] = { "patterns", "pi2sf", "ccnt", 0 };
+      const size_t bytes[] = { trie_bytes, _bytes (_pi2sf), _bytes (_ccnt) };
+      _report_memory ("pruned", names, bytes);
+    }
+    // keep mined patterns by count so that the number of patterns and the
+    // (estimated) size of .da, .c2i, .p2f and .fs are within the limits
+    void prune_patterns (const size_t max_patterns, const int min_count, const size_t max_bytes) {
+      std::fprintf (stderr, "pruning patterns by count...");
+      const size_t num = _pi2sf.size ();
+      std::vector <std::pair <int, size_t> > cand; // <count, index>
+      std::vector <bool> keep (num, false), fused (_fbag.size (), false);
+      size_t nkeep (0), bytes ((CP_MAX + 2) * sizeof (uint16_t));
+      for (size_t i = 0; i < num; ++i)
+        if (_seed[i])
+          keep[i] = true, ++nkeep, bytes += _pattern_bytes (_pi2sf[i], fused);
+        else if (_pi2sf[i].count >= min_count)
+          cand.push_back (std::make_pair (_pi2sf[i].count, num - i)); // earlier first
+      std::sort (cand.begin (), cand.end (), std::greater <std::pair <int, size_t> > ());
+      for (size_t j = 0; j < cand.size (); ++j) {
+        const pat_info_t& p = _pi2sf[num - cand[j].second];
+        if (max_patterns && nkeep >= max_patterns) break;
+        if (max_bytes && bytes + _pattern_bytes (p, fused, false) > max_bytes) break;
+        keep[num - cand[j].second] = true, ++nkeep, bytes += _pattern_bytes (p, fused);
+      }
+      size_t n = 0;
+      for (size_t i = 0; i < num; ++i)
+        if (keep[i]) _pi2sf[n++] = _pi2sf[i];
+        else { // uncount characters and prev POS
+          const pat_info_t& p = _pi2sf[i];
+          for (int j (0), b (0), len (p.surf.size ()); j < len; j += b)
+            _ccnt[unicode (&p.surf[j], b)].first -= p.count + 1;
+          if (p.ti_prev != -1)
+            _ccnt[CP_MAX + 1 + p.ti_prev].first -= p.count + 1;
+        }
+      _pi2sf.erase (_pi2sf.begin () + n, _pi2sf.end ());
+      _seed.clear ();
+      std::fprintf (stderr, "done; %ld -> %ld patterns (~%ld bytes)\n", num, n, bytes);
     }
     void write_patterns (const std::string& m) { // output compiled patterns
       std::fprintf (stderr, "building DA trie from patterns..");
       bag_t <std::pair <int, int> > fsbag;
-      bag_t <std::string> fbag; // core (sorted, compressed)
+      bag_t <std::string> fbag; // lex (features after core)
       ccedar::da_ da;
-      IF_COMPACT (fbag.to_i (",*,*,*\n")); // f0: features for unk (lex)
-      IF_NOT_COMPACT (fbag.to_i (std::string (FEAT_UNK) + ",*,*,*\n")); // f0: unk
+      fbag.to_i (",*,*,*\n"); // f0: features for unk (lex)
       fsbag.to_i (std::make_pair (0, 1)); // unk <f0, t1>
       // save c2i
-      std::sort (_ccnt.rbegin (), _ccnt.rend () - 1);
+      _parallel_sort (_ccnt.rbegin (), _ccnt.rend () - 1, std::less <std::pair <size_t, int> > (), _nthreads);
       std::vector <uint16_t> c2i (_ccnt.size ());
       for (size_t i = 1; i < _ccnt.size () && _ccnt[i].first; ++i)
         c2i[_ccnt[i].second] = static_cast <uint16_t> (i);
-      _write_array (c2i.data (), CP_MAX + 2, m + ".c2i"); // chop POS except BOS
-      FILE* writer = _fopen (m.c_str (), "w");
-      std::sort (_pi2sf.rbegin (), _pi2sf.rend ());
-      for (std::vector <pat_info_t>::iterator it = _pi2sf.begin (); it != _pi2sf.end (); ++it) { // output pattern
-        it->print (writer, _tbag, _fbag);
+      std::vector <std::vector <int> > keys;
+      std::vector <int> vals;
+      _parallel_sort (_pi2sf.rbegin (), _pi2sf.rend (), std::less <pat_info_t> (), _nthreads);
+      for (std::vector <pat_info_t>::iterator it = _pi2sf.begin (); it != _pi2sf.end (); ++it) {
         const std::string& fs =_fbag.to_s (it->fi);
         const int ti_prev = it->ti_prev;
-        size_t pos = _strchr_n (fs.c_str (), ',', NUM_POS_FIELD) - fs.c_str ();
+        const size_t pos = _strchr_n (fs.c_str (), ',', NUM_POS_FIELD) - fs.c_str ();
         const int ti = _tbag.to_i (fs.substr (0, pos)); // core
-        IF_NOT_COMPACT (pos = 0);                       // lemma -> core + lemma
         const int fi = fbag.to_i (fs.substr (pos));
         const int pi = fsbag.to_i (std::make_pair (fi, ti));
         // save pattern trie
@@ -240,16 +459,66 @@ namespace jagger {
         for (int i (0), b (0), len (it->surf.size ()); i < len; i += b)
           pv.push_back (c2i[unicode (&it->surf[i], b)]);
         if (ti_prev + 1) pv.push_back (c2i[CP_MAX + 1 + ti_prev]);
-        union { struct { uint32_t shift : MAX_PATTERN_BITS, ctype : 4, id: 20; bool : 1; }; int r; } s = { { it->shift, it->ctype, static_cast <uint32_t> (pi) } };
-        da.update (&pv[0], pv.size ()) = s.r;
+        token_t s = { { it->shift, it->ctype, static_cast <uint32_t> (pi) } };
+        keys.push_back (pv);
+        vals.push_back (s.r);
+      }
+      std::vector <size_t> offsets, offsets_, dummy;
+      const size_t base_offset = _tbag.serialize (0, offsets_); // each core once
+      const size_t fs_size = fbag.serialize (0, offsets, base_offset); // then lex
+      { // check and report bit widths packed in .da / .p2f / .fs before any output
+        size_t max_ci (0), max_shift (0), max_surf (1), max_flen (0);
+        for (size_t i = 0; i < c2i.size (); ++i) max_ci = std::max (max_ci, static_cast <size_t> (c2i[i]));
+        for (size_t i = 0; i < _pi2sf.size (); ++i) {
+          max_shift = std::max (max_shift, static_cast <size_t> (_pi2sf[i].shift));
+          max_surf  = std::max (max_surf, _pi2sf[i].surf.size ());
+        }
+        for (size_t i = 0; i < fsbag.size (); ++i) {
+          const int fi (fsbag.to_s (i).first), ti (fsbag.to_s (i).second);
+          max_flen = std::max (max_flen, std::max (_tbag.to_s (ti).size (), fbag.to_s (fi).size ()));
+        }
+        // JAGGER_PATTERN_BITS also caps the length of mined patterns (max_plen)
+        const int kb (_bits (max_ci)), pb (std::max (_bits (max_shift), _bits (max_surf - 1))), fb (_bits (max_flen));
+        ERR_IF (kb > static_cast <int> (MAX_KEY_BITS), "rebuild with -DJAGGER_KEY_BITS=%d for %ld chars and POSs", kb, static_cast <long> (max_ci));
+        ERR_IF (fb > static_cast <int> (MAX_FEATURE_BITS), "rebuild with -DJAGGER_FEATURE_BITS=%d for %ld-byte features", fb, static_cast <long> (max_flen));
+        ERR_IF ((fsbag.size () - 1) >> MAX_ID_BITS, "rebuild with smaller -DJAGGER_PATTERN_BITS for %ld features", static_cast <long> (fsbag.size ()));
+        ERR_IF (base_offset >> 18, "core features exceed %d bytes", 1 << 18);
+        ERR_IF (fs_size >> 28, "feature strings exceed %d bytes", 1 << 28);
+        std::fprintf (stderr, "tightest widths: -DJAGGER_KEY_BITS=%d -DJAGGER_PATTERN_BITS=%d -DJAGGER_FEATURE_BITS=%d (pattern bits also cap pattern length in training)..", kb, pb, fb);
       }
+      _write_array (c2i.data (), CP_MAX + 2, m + ".c2i"); // chop POS except BOS
+      FILE* writer = _fopen (m.c_str (), "w");
+      for (std::vector <pat_info_t>::const_iterator it = _pi2sf.begin (); it != _pi2sf.end (); ++it)
+        it->print (writer, _tbag, _fbag); // output pattern
       std::fclose (writer);
+      { // build trie from sorted patterns
+        std::vector <size_t> ids (keys.size ()), lens (keys.size ());
+        std::vector <const int*> keys_ (keys.size ());
+        std::vector <int> vals_ (keys.size ());
+        for (size_t i = 0; i < ids.size (); ++i) ids[i] = i;
+        _parallel_sort (ids.begin (), ids.end (), key_less (keys), _nthreads);
+        for (size_t i = 0; i < ids.size (); ++i)
+          keys_[i] = &keys[ids[i]][0], lens[i] = keys[ids[i]].size (), vals_[i] = vals[ids[i]];
+        da.build (ids.size (), keys_.data (), lens.data (), vals_.data ());
+      }
       _write_array (da.array (), da.size (), m + ".da");
-      // save feature strings
-      std::vector <size_t> offsets, offsets_;
+      size_t kbytes = _bytes (keys);
+      for (size_t i = 0; i < keys.size (); ++i) kbytes += _bytes (keys[i]);
+      const size_t bytes[] = { da.size () * (sizeof (ccedar::da_::node) + 2), kbytes };
+      // save pattern counts indexed by trie node for lattice output
+      std::vector <uint32_t> cnt (da.size (), 0);
+      for (size_t i = 0; i < keys.size (); ++i) {
+        size_t from (0), pos (0);
+        da.traverse (&keys[i][0], from, pos, keys[i].size ());
+        cnt[da.array ()[from].base] = static_cast <uint32_t> (_pi2sf[i].count);
+      }
+      _write_array (cnt.data (), cnt.size (), m + ".cnt");
+      // save feature strings at the offsets computed above
       writer = _fopen ((m + ".fs").c_str (), "wb");
-      IF_COMPACT (const size_t base_offset = _tbag.serialize (writer, offsets_));
-      fbag.serialize (writer, offsets); // (core +) lemma
+      _tbag.serialize (writer, dummy);
+      fbag.serialize (writer, dummy);
+      const char pad[WIDE_SIZE] = {}; // slack for wide copy
+      std::fwrite (pad, 1, WIDE_SIZE, writer);
       std::fclose (writer);
       // save mapping from feature ID to feature strings
       feat_info_t finfo = {0};
@@ -259,33 +528,163 @@ namespace jagger {
         p2f[pi].ti = c2i[CP_MAX + 1 + ti];
         p2f[pi].core_feat_len = _tbag.to_s (ti).size ();
         p2f[pi].feat_len = fbag.to_s (fi).size ();
-        IF_COMPACT (p2f[pi].core_feat_offset = offsets_[ti]);
-        IF_COMPACT (p2f[pi].feat_offset = base_offset + offsets[fi]);
-        IF_NOT_COMPACT (p2f[pi].feat_offset = offsets[fi]);
+        p2f[pi].core_feat_offset = offsets_[ti];
+        p2f[pi].feat_offset = offsets[fi];
       }
       _write_array (p2f.data (), p2f.size (), m + ".p2f");
-      std::fprintf (stderr, "done.\n");
+      // save trie for segmentation; values hold POS ids instead of pattern ids
+      std::vector <ccedar::da_::node> wda (da.array (), da.array () + da.size ());
+      ccedar::da_::fold_values (wda.data (), wda.size (), p2f.data ());
+      _write_array (wda.data (), wda.size (), m + ".wda");
+      model_header_t h = model_header ();
+      hash_model (m, h.hash);
+      _write_array (&h, 1, m + ".hdr");
+      std::fprintf (stderr, "done; model hash %016llx\n", static_cast <unsigned long long> (h.hash[6]));
+      const char* names[] = { "da", "keys", 0 };
+      _report_memory ("built", names, bytes);
+    }
+  };
+  static std::string _core (const char* f, const char* eol) { // POS fields after '\t'
+    const char* p = ++f;
+    for (int n = 0; p < eol && *p != '\n' && (*p != ',' || ++n < NUM_POS_FIELD); ++p) ;
+    return std::string (f, p);
+  }
+  struct eval_t { // counts to compute F1, throughput and trie steps
+    size_t gold, sys, seg, tag, bytes, input;
+    double sec;
+    uint64_t nstep, nsearch;
+    eval_t& operator+= (const eval_t& e) {
+      gold += e.gold, sys += e.sys, seg += e.seg, tag += e.tag, bytes += e.bytes, input += e.input;
+      sec += e.sec, nstep += e.nstep, nsearch += e.nsearch;
+      return *this;
     }
   };
+  // segmentation / tagging (POS) F1 of a compiled model on data in the
+  // training format; tokens are matched by their offsets in raw text
+  static eval_t evaluate (const std::string& m, const char* begin, const char* end) {
+    typedef std::pair <std::pair <size_t, size_t>, std::string> span_t; // <<begin, end>, POS>
+    std::vector <span_t> gold, sys;
+    std::string input, output;
+    eval_t e = {};
+    { // read gold tokens
+      line_scanner ls (begin, end);
+      for (const char *line (0), *eol (0); ls.next (line, eol); ) {
+        if (eol - line >= 4 && std::memcmp (line, "EOS\n", 4) == 0) {
+          input += '\n';
+          continue;
+        }
+        const char* f = static_cast <const char*> (std::memchr (line, '\t', eol - line));
+        if (! f) continue;
+        gold.push_back (span_t (std::make_pair (input.size (), input.size () + (f - line)), _core (f, eol)));
+        input.append (line, f);
+      }
+    }
+    tagger t;
+    t.read_model (m);
+    {
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+      simple_writer writer (output);
+      stream_tagger <true> st (t, writer);
+      st.feed (input.data (), input.size ());
+      st.finish ();
+      e.sec = std::chrono::duration <double> (std::chrono::steady_clock::now () - start).count ();
+    }
+    e.nsearch = t.count_steps (input.data (), input.data () + input.size (), e.nstep);
+    line_scanner ls (output.data (), output.data () + output.size ());
+    size_t pos = 0;
+    for (const char *line (0), *eol (0); ls.next (line, eol); ) {
+      const char* f = static_cast <const char*> (std::memchr (line, '\t', eol - line));
+      if (! f) { ++pos; continue; } // EOS
+      sys.push_back (span_t (std::make_pair (pos, pos + (f - line)), _core (f, eol)));
+      pos += f - line;
+    }
+    for (size_t i (0), j (0); i < gold.size () && j < sys.size (); )
+      if (gold[i].first.second == sys[j].first.second) {
+        if (gold[i].first.first == sys[j].first.first)
+          ++e.seg, e.tag += gold[i].second == sys[j].second;
+        ++i, ++j;
+      } else if (gold[i].first.second < sys[j].first.second) ++i; else ++j;
+    static const char* ext[] = { ".da", ".c2i", ".p2f", ".fs", 0 };
+    for (size_t i = 0; ext[i]; ++i) {
+      const mapped_file file (m + ext[i]);
+      e.bytes += file.end () - file.begin ();
+    }
+    e.gold = gold.size (), e.sys = sys.size (), e.input = input.size ();
+    return e;
+  }
+  static void report (const char* name, const eval_t& e, const size_t nmodel = 1) {
+    const double p (100.0 * e.seg / std::max (e.sys, size_t (1))), r (100.0 * e.seg / std::max (e.gold, size_t (1)));
+    const double tp (100.0 * e.tag / std::max (e.sys, size_t (1))), tr (100.0 * e.tag / std::max (e.gold, size_t (1)));
+    std::fprintf (stderr, "evaluating on %s: %ld tokens; seg P/R/F1 %.2f/%.2f/%.2f, POS F1 %.2f; model %ld bytes; %.2f MB/s, %.2f trie steps / search\n",
+                  name, static_cast <long> (e.gold), p, r, p + r > 0 ? 2 * p * r / (p + r) : 0.0, tp + tr > 0 ? 2 * tp * tr / (tp + tr) : 0.0,
+                  static_cast <long> (e.bytes / std::max (nmodel, size_t (1))), e.input / 1048576.0 / std::max (e.sec, 1e-9), static_cast <double> (e.nstep) / std::max (e.nsearch, uint64_t (1)));
+  }
 }
 
 int main (int argc, char** argv) {
   std::string m, train;
   std::vector <std::string> dict;
+  std::string test;
+  size_t nthreads = std::max (1u, std::thread::hardware_concurrency ());
+  size_t max_patterns (0), max_bytes (0), max_mem (0), nfold (0);
+  int min_count = 0;
   { // options (minimal)
     extern char *optarg;
     extern int optind;
-    for (int opt = 0; (opt = getopt (argc, argv, "m:d:u:")) != -1; )
+    for (int opt = 0; (opt = getopt (argc, argv, "m:d:u:t:p:c:s:e:M:k:")) != -1; )
       switch (opt) {
         case 'm': m = optarg; m += "/patterns"; break;
         case 'd': dict.insert (dict.begin (), optarg); break;
         case 'u': dict.push_back (optarg); break;
+        case 't': nthreads = std::max (1ul, std::strtoul (optarg, NULL, 10)); break;
+        case 'p': max_patterns = std::strtoul (optarg, NULL, 10); break;
+        case 'c': min_count = std::atoi (optarg); break;
+        case 's': max_bytes = std::strtoul (optarg, NULL, 10); break;
+        case 'e': test = optarg; break;
+        case 'M': max_mem = std::strtoul (optarg, NULL, 10); break;
+        case 'k': nfold = std::strtoul (optarg, NULL, 10); break;
       }
-    if (optind == argc || m.empty ()) errx (1, "Extract patterns for Jagger from dictionary and training data\nCopyright (c) 2023- Naoki Yoshinaga, All rights reserved.\n\nUsage: %s [-m dir -d dict -u dict] train\n\nOptions:\n -m dir \tdirectory to store patterns\n -d dict\tdictionary in CSV format\n -u user_dict\tuser-defined dictionary in CSV format\n", argv[0]);
-    train = argv[optind];
+    if ((optind == argc && test.empty ()) || m.empty () || nfold == 1) errx (1, "Extract patterns for Jagger from dictionary and training data\nCopyright (c) 2023- Naoki Yoshinaga, All rights reserved.\n\nUsage: %s [-m dir -d dict -u dict -t threads -p num -c count -s bytes -e test -M bytes -k folds] train\n\nOptions:\n -m dir \tdirectory to store patterns\n -d dict\tdictionary in CSV format\n -u user_dict\tuser-defined dictionary in CSV format\n -t threads\tnumber of threads to sort patterns (default: # cores)\n -p num\tkeep at most num patterns (by count)\n -c count\tdrop mined patterns seen less than count times\n -s bytes\tkeep patterns within approx. bytes of model\n -e test\tevaluate the model on held-out data in the training format\n \t(evaluate the model in dir if train is omitted)\n -M bytes\tstop adding pattern candidates beyond approx. bytes of candidates\n -k folds\tcross-validate on train split into folds (>= 2) before training\n", argv[0]);
+    if (optind < argc) train = argv[optind];
+  }
+  if (! train.empty ()) {
+    std::fprintf (stderr, "reading training data and dictionary...");
+    const jagger::corpus_t corpus (train);
+    std::vector <jagger::dict_entry_t> entries;
+    jagger::pattern_builder::read_dict (dict, entries);
+    std::fprintf (stderr, "done; %ld sentences, %ld dictionary words\n", static_cast <long> (corpus.size ()), static_cast <long> (entries.size ()));
+    jagger::eval_t cv = {};
+    for (size_t i = 0; i <= nfold; ++i) { // models on folds, then on the whole
+      char buf[32];
+      std::sprintf (buf, ".cv%ld", static_cast <long> (i));
+      const std::string m_ = i < nfold ? m + buf : m;
+      std::vector <jagger::sent_range_t> ranges;
+      const jagger::range_t held = corpus.fold (i, nfold, ranges);
+      if (i < nfold)
+        std::fprintf (stderr, "fold %ld/%ld: %ld sentences held out\n", static_cast <long> (i + 1), static_cast <long> (nfold), static_cast <long> ((i + 1) * corpus.size () / nfold - i * corpus.size () / nfold));
+      jagger::pattern_builder builder (nthreads);
+      builder.extract_patterns (corpus, ranges, entries, max_mem);
+      if (max_patterns || min_count || max_bytes)
+        builder.prune_patterns (max_patterns, min_count, max_bytes);
+      builder.write_patterns (m_);
+      if (i == nfold) break;
+      const jagger::eval_t e = jagger::evaluate (m_, held.first, held.second);
+      jagger::report ((train + buf).c_str (), e);
+      cv += e;
+      std::vector <std::string> fns (1, m_); // fold model
+      fns.push_back (m_ + ".hdr");
+      for (size_t j = 0; jagger::MODEL_FILES[j]; ++j)
+        fns.push_back (m_ + jagger::MODEL_FILES[j]);
+      for (size_t j = 0; j < fns.size (); ++j)
+        if (std::remove (fns[j].c_str ()) != 0)
+          std::fprintf (stderr, "warning: cannot remove %s\n", fns[j].c_str ());
+    }
+    if (nfold)
+      jagger::report ((train + " (cross-validation)").c_str (), cv, nfold);
+  }
+  if (! test.empty ()) {
+    const jagger::mapped_file file (test);
+    jagger::report (test.c_str (), jagger::evaluate (m, file.begin (), file.end ()));
   }
-  jagger::pattern_builder builder;
-  builder.extract_patterns (train, dict);
-  builder.write_patterns (m);
   return 0;
 }